@@ -0,0 +1,7 @@
+// camera, shared by every program through one uniform buffer
+layout (std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    mat4 VP;
+    float time; // animation clock, seconds
+};
@@ -1,14 +1,25 @@
 #version 330 core
 
 // Interpolated values from the vertex shaders
+#ifdef TEXTURED
+in vec2 fragTexCoord;
+
+// Texture sample for the whole mesh
+uniform sampler2D texSampler;
+#else
 in vec3 fragColor;
+#endif
 
 // output data
 out vec3 color;
 
 void main()
 {
-    // Output color = color specified in the vertex shader,
-    // interpolated between all 3 surrounding vertices of the triangle
+    // Output color = color specified in, or sampled at the texture coord from,
+    // the vertex shader, interpolated between all 3 surrounding vertices of the triangle
+#ifdef TEXTURED
+    color = texture( texSampler, fragTexCoord ).rgb;
+#else
     color = fragColor;
+#endif
 }
@@ -1,22 +1,59 @@
 #version 330 core
 
+// Built once per permutation of :
+//   TEXTURED - colour comes from the texture atlas instead of the vertices
+//   ANIMATED - instances spin and bob
+
 // input data : sent from main program
 layout (location = 0) in vec3 vertexPosition;
+#ifdef TEXTURED
+layout (location = 2) in vec2 vertexTexCoord;
+#else
 layout (location = 1) in vec3 vertexColor;
+#endif
+
+// per instance model matrix, fed by the render queue
+layout (location = 4) in mat4 instanceModel;
+
+#ifdef ANIMATED
+// per instance periodic motion : x bob amplitude, y bob period (s), z bob phase, w spin (degrees/s)
+layout (location = 8) in vec4 instanceMotion;
+#endif
+
+#ifdef TEXTURED
+// per instance atlas region : u, v, width, height
+layout (location = 9) in vec4 instanceUVRect;
+#endif
 
-uniform mat4 MVP;
+#include "Camera.glsl"
 
 // output data : used by fragment shader
+#ifdef TEXTURED
+out vec2 fragTexCoord;
+#else
 out vec3 fragColor;
+#endif
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+#ifdef ANIMATED
+    // Spin about y, then bob along y on a triangle wave - the same closed forms collision uses
+    float a = radians(instanceMotion.w * time);
+    vec4 v = vec4(cos(a)*vertexPosition.x + sin(a)*vertexPosition.z, vertexPosition.y, cos(a)*vertexPosition.z - sin(a)*vertexPosition.x, 1);
+    float bob = instanceMotion.x * (1.0 - abs(1.0 - 2.0*fract(time/instanceMotion.y + instanceMotion.z)));
+#else
+    vec4 v = vec4(vertexPosition, 1);
+    float bob = 0.0;
+#endif
 
-    // The color of each vertex will be interpolated
+    // The color or texture coord of each vertex will be interpolated
     // to produce the color of each fragment
+#ifdef TEXTURED
+    fragTexCoord = instanceUVRect.xy + vertexTexCoord * instanceUVRect.zw;
+#else
     fragColor = vertexColor;
+#endif
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * model * position
+    gl_Position = VP * (instanceModel * v + vec4(0, bob, 0, 0));
 }
@@ -0,0 +1,20 @@
+#version 330 core
+
+// input data : corner of the unit quad every segment is drawn from
+layout (location = 0) in vec2 vertexPosition;
+
+// per instance segment : rectangle in pixels (x, y, width, height) and colour
+layout (location = 4) in vec4 instanceRect;
+layout (location = 5) in vec3 instanceColor;
+
+// pixels to clip space - the HUD ignores the world camera
+uniform mat4 screen;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    fragColor = instanceColor;
+    gl_Position = screen * vec4(instanceRect.xy + vertexPosition * instanceRect.zw, 0, 1);
+}
@@ -0,0 +1,27 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+layout (location = 3) in float vertexBone;
+
+#include "Camera.glsl"
+
+// model matrix of every bone of the rig
+uniform mat4 Bones[5];
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    // Each vertex follows exactly one bone
+    vec4 v = Bones[int(vertexBone)] * vec4(vertexPosition, 1);
+
+    // The color of each vertex will be interpolated
+    // to produce the color of each fragment
+    fragColor = vertexColor;
+
+    // Output position of the vertex, in clip space : VP * position
+    gl_Position = VP * v;
+}
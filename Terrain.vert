@@ -0,0 +1,29 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec3 vertexColor;
+
+// per instance data : voxel centre in xyz, material id in w
+layout (location = 3) in vec4 instanceOffset;
+
+#include "Camera.glsl"
+
+// the mesh stores positions as int16 multiples of this
+uniform float positionScale;
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    // Move the shared voxel mesh to this instance's cell
+    vec4 v = vec4(vertexPosition * positionScale + instanceOffset.xyz, 1);
+
+    // The color of each vertex will be interpolated
+    // to produce the color of each fragment
+    fragColor = vertexColor;
+
+    // Output position of the vertex, in clip space : VP * position
+    gl_Position = VP * v;
+}
@@ -1,14 +1,17 @@
 #version 330 core
 
 // Interpolated values from the vertex shaders
-in vec3 fragColor;
+in vec4 fragColor;
+in vec2 fragTexCoord;
+
+// glyph coverage, single channel
+uniform sampler2D glyphSampler;
 
 // output data
-out vec3 color;
+out vec4 color;
 
 void main()
 {
-    // Output color = color specified in the vertex shader,
-    // interpolated between all 3 surrounding vertices of the triangle
-    color = fragColor;
-}
\ No newline at end of file
+    // Text colour, blended by how much of the pixel the glyph covers
+    color = vec4(fragColor.rgb, fragColor.a * texture( glyphSampler, fragTexCoord ).r);
+}
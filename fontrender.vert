@@ -1,17 +1,20 @@
 #version 330 core
 
-uniform mat4 MVP;
-uniform vec3 pen;
-uniform vec3 fontColor;
+// input data : glyph corner in pixels, its colour and its place in the glyph atlas
+layout (location = 0) in vec2 vertexPosition;
+layout (location = 1) in vec4 vertexColor;
+layout (location = 2) in vec2 vertexTexCoord;
 
-in vec3 vertexPosition;
-in vec3 vertexNormal;
+// pixels to clip space - text ignores the world camera
+uniform mat4 screen;
 
-out vec3 fragColor;
+// output data : used by fragment shader
+out vec4 fragColor;
+out vec2 fragTexCoord;
 
 void main ()
 {
-    gl_Position = MVP * (vec4(vertexPosition, 1.0) + vec4(pen, 1.0));
-    // fragColor = vec3((vertexNormal.x+1)/2,(vertexNormal.y+1)/2,(vertexNormal.z+1)/2);
-    fragColor = fontColor;
-}
\ No newline at end of file
+    fragColor = vertexColor;
+    fragTexCoord = vertexTexCoord;
+    gl_Position = screen * vec4(vertexPosition, 0, 1);
+}
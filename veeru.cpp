@@ -2,6 +2,18 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
@@ -9,7 +21,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <glad/glad.h>
-#include <FTGL/ftgl.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
 #include <GLFW/glfw3.h>
 #include <SOIL/SOIL.h>
 #include <thread>
@@ -19,16 +32,193 @@
 
 using namespace std;
 
+/* Kinds of GL object owned through the resource registry */
+enum { GL_RESOURCE_VERTEX_ARRAY, GL_RESOURCE_BUFFER, GL_RESOURCE_TEXTURE, GL_RESOURCE_PROGRAM, GL_RESOURCE_KINDS };
+const char* gl_resource_names[GL_RESOURCE_KINDS] = {"VAOs", "buffers", "textures", "programs"};
+
+struct GLResource {
+	int kind;
+	GLuint name;
+	int refs;
+	long bytes; // GPU memory held, as far as we know it
+};
+
+/* Live count and bytes per kind, and the objects whose last handle went away this frame */
+struct GLResourceRegistry {
+	int count[GL_RESOURCE_KINDS];
+	long bytes[GL_RESOURCE_KINDS];
+	vector<GLResource*> released;
+} gl_resources;
+
+/* Owning handle to a GL object - copies share the object, and it is deleted
+   at the next frame boundary once the last copy is gone */
+template <int Kind>
+struct GLHandle {
+	GLResource* resource;
+
+	GLHandle() : resource(NULL) {}
+	GLHandle(const GLHandle& other) : resource(other.resource)
+	{
+		if (resource)
+			resource->refs++;
+	}
+	~GLHandle() { release(); }
+	GLHandle& operator= (const GLHandle& other)
+	{
+		if (other.resource)
+			other.resource->refs++;
+		release();
+		resource = other.resource;
+		return *this;
+	}
+	operator GLuint() const { return resource ? resource->name : 0; }
+
+	void release()
+	{
+		if (resource && --resource->refs==0)
+			gl_resources.released.push_back(resource);
+		resource = NULL;
+	}
+
+	/* Take ownership of a freshly created GL name */
+	static GLHandle adopt(GLuint name)
+	{
+		GLHandle handle;
+		handle.resource = new GLResource();
+		handle.resource->kind = Kind;
+		handle.resource->name = name;
+		handle.resource->refs = 1;
+		gl_resources.count[Kind]++;
+		return handle;
+	}
+
+	void setBytes(long bytes)
+	{
+		gl_resources.bytes[Kind] += bytes - resource->bytes;
+		resource->bytes = bytes;
+	}
+};
+typedef GLHandle<GL_RESOURCE_VERTEX_ARRAY> VertexArrayHandle;
+typedef GLHandle<GL_RESOURCE_BUFFER> BufferHandle;
+typedef GLHandle<GL_RESOURCE_TEXTURE> TextureHandle;
+typedef GLHandle<GL_RESOURCE_PROGRAM> ProgramHandle;
+
+VertexArrayHandle genVertexArray ()
+{
+	GLuint name;
+	glGenVertexArrays(1, &name);
+	return VertexArrayHandle::adopt(name);
+}
+
+BufferHandle genBuffer ()
+{
+	GLuint name;
+	glGenBuffers(1, &name);
+	return BufferHandle::adopt(name);
+}
+
+TextureHandle genTexture ()
+{
+	GLuint name;
+	glGenTextures(1, &name);
+	return TextureHandle::adopt(name);
+}
+
+/* (Re)allocate the storage of a buffer and account for its size */
+void bufferData (BufferHandle& buffer, GLenum target, GLsizeiptr size, const void* data, GLenum usage)
+{
+	glBindBuffer (target, buffer);
+	glBufferData (target, size, data, usage);
+	buffer.setBytes(size);
+}
+
+/* Shadow of the GL state the draw helpers set, so calls that would change nothing are skipped.
+   ~0 marks a value we do not know - nothing GL hands out has that name */
+struct GLStateCache {
+	GLuint program;
+	GLuint vertex_array;
+	GLuint texture;
+	GLenum polygon_mode;
+	int issued, elided; // state calls this frame
+	int last_issued, last_elided; // state calls in the last complete frame
+} gl_state = {~0u, ~0u, ~0u, ~0u, 0, 0, 0, 0};
+
+/* Delete the objects released during the frame - call once the frame has been submitted */
+void collectGLResources ()
+{
+	for (size_t i = 0; i < gl_resources.released.size(); i++)
+	{
+		GLResource* resource = gl_resources.released[i];
+		switch (resource->kind)
+		{
+			case GL_RESOURCE_VERTEX_ARRAY:
+				glDeleteVertexArrays(1, &resource->name);
+				if (gl_state.vertex_array==resource->name)
+					gl_state.vertex_array = ~0u; // the name may be handed out again
+				break;
+			case GL_RESOURCE_BUFFER:
+				glDeleteBuffers(1, &resource->name);
+				break;
+			case GL_RESOURCE_TEXTURE:
+				glDeleteTextures(1, &resource->name);
+				if (gl_state.texture==resource->name)
+					gl_state.texture = ~0u;
+				break;
+			case GL_RESOURCE_PROGRAM:
+				glDeleteProgram(resource->name);
+				if (gl_state.program==resource->name)
+					gl_state.program = ~0u;
+				break;
+		}
+		gl_resources.count[resource->kind]--;
+		gl_resources.bytes[resource->kind] -= resource->bytes;
+		delete resource;
+	}
+	gl_resources.released.clear();
+}
+
+/* Print the live GL objects and their memory, per kind */
+void reportGLResources ()
+{
+	cout<<"GL resources:";
+	for (int k = 0; k < GL_RESOURCE_KINDS; k++)
+	{
+		cout<<" "<<gl_resources.count[k]<<" "<<gl_resource_names[k];
+		if (gl_resources.bytes[k])
+			cout<<" ("<<gl_resources.bytes[k]/1024<<" KB)";
+		cout<<(k+1<GL_RESOURCE_KINDS ? "," : "");
+	}
+	cout<<endl;
+}
+
+/* Object counts the leak check compares against - taken at the first check, and
+   again after allocations the game means to keep */
+struct GLLeakBaseline {
+	bool settled;
+	int count[GL_RESOURCE_KINDS];
+} gl_leak_baseline;
+
+/* Call after intentional allocations (a terrain chunk, a texture) - the next check takes a new baseline */
+void resettleGLResources ()
+{
+	gl_leak_baseline.settled = false;
+}
+
 struct VAO {
-	GLuint VertexArrayID;
-	GLuint VertexBuffer;
-	GLuint ColorBuffer;
-	GLuint TextureBuffer;
-	GLuint TextureID;
+	VertexArrayHandle VertexArrayID;
+	BufferHandle VertexBuffer; // interleaved, see struct Vertex
+	BufferHandle IndexBuffer; // 16-bit indices
+	TextureHandle TextureID;
+	glm::vec4 AtlasRect; // part of the texture the UVs map into - u, v, width, height
+	int Layout; // VERTEX_COLORED, VERTEX_TEXTURED or VERTEX_SKINNED
+	unsigned EnabledAttributes; // bit per vertex attribute enabled on this VAO
+	unsigned MeshID; // creation order, identifies the mesh in render queue keys
 
 	GLenum PrimitiveMode; // GL_POINTS, GL_LINE_STRIP, GL_LINE_LOOP, GL_LINES, GL_LINE_STRIP_ADJACENCY, GL_LINES_ADJACENCY, GL_TRIANGLE_STRIP, GL_TRIANGLE_FAN, GL_TRIANGLES, GL_TRIANGLE_STRIP_ADJACENCY and GL_TRIANGLES_ADJACENCY
 	GLenum FillMode; // GL_FILL, GL_LINE
-	int NumVertices;
+	int NumVertices; // distinct vertices in the VBO
+	int NumIndices;
+	float PositionScale; // positions are stored as int16 multiples of this
 };
 typedef struct VAO VAO;
 
@@ -36,93 +226,272 @@ struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID; // For use with normal shader
-	GLuint TexMatrixID; // For use with texture shader
+	glm::mat4 VP; // projection * view, resolved once per frame by updateCamera
+	GLuint TerrainScaleID; // Position scale of the instanced voxel mesh
+	GLuint BonesID; // Bone matrix array of the skinned shader
+	BufferHandle CameraBlock; // std140 Camera uniform block shared by every program
 } Matrices;
 
-struct FTGLFont {
-	FTFont* font;
-	GLuint fontMatrixID;
-	GLuint fontColorID;
-} GL3Font;
+/* Layout of the Camera uniform block (std140), at this binding point in every program */
+struct CameraUniforms {
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::mat4 VP;
+	float time; // animation clock, seconds
+	float pad[3];
+};
+const GLuint CAMERA_BLOCK_BINDING = 0;
+
+/* FNV-1a, 64 bit - for cache keys */
+unsigned long long hashBytes (const void* data, size_t size, unsigned long long hash=14695981039346656037ULL)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash^bytes[i])*1099511628211ULL;
+	return hash;
+}
+
+/* Key for a batch of source files - their names and contents */
+unsigned long long hashFiles (const char* filenames[], int count)
+{
+	unsigned long long hash = hashBytes("", 0);
+	for (int i = 0; i < count; i++)
+	{
+		ifstream file(filenames[i], ios::in|ios::binary);
+		string contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+		hash = hashBytes(filenames[i], strlen(filenames[i])+1, hash);
+		hash = hashBytes(contents.data(), contents.size(), hash);
+	}
+	return hash;
+}
+
+/* Generated files live here, named by their key */
+const char* cache_directory = ".cache";
+
+string cachePath (const char* prefix, unsigned long long key, const char* extension)
+{
+	char name[64];
+	sprintf(name, "%s/%s-%016llx.%s", cache_directory, prefix, key, extension);
+	return name;
+}
 
-GLuint programID, fontProgramID, textureProgramID;
+/* Feature switches the mesh shaders are specialized on - each set bit becomes a
+   #define, so every variant runs only the code it needs */
+enum {
+	SHADER_TEXTURED = 1<<0, // colour from the texture atlas instead of the vertices
+	SHADER_ANIMATED = 1<<1, // per instance spin and bob
+	SHADER_FEATURES = 2
+};
+const char* shader_feature_defines[SHADER_FEATURES] = {"TEXTURED", "ANIMATED"};
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+ProgramHandle fontProgramID, terrainProgramID, skinnedProgramID, segmentProgramID;
+ProgramHandle meshPrograms[1<<SHADER_FEATURES]; // Sample_GL3 built for every combination of features
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+/* Read a shader source file, expanding #include "file" lines in place. #line
+   directives keep compiler messages pointing at the right line, with files
+   numbered in the order they are read */
+string preprocessShader (const char* path, vector<string>& files, int depth=0)
+{
+	int index = files.size();
+	files.push_back(path);
+	ifstream stream(path, ios::in);
+	if (!stream.is_open())
+		cout << "Error: Could not read shader `" << path << "'" << endl;
+	string source, line;
+	char directive[64];
+	for (int number = 1; getline(stream, line); number++)
+	{
+		size_t start = line.find_first_not_of(" \t");
+		if (start==string::npos || line.compare(start, 8, "#include")!=0)
+		{
+			source += line + "\n";
+			continue;
+		}
+		size_t open = line.find('"', start), close = line.find('"', open+1);
+		if (open==string::npos || close==string::npos || depth>=8)
+		{
+			cout << "Error: Bad #include at " << path << ":" << number << endl;
+			continue;
+		}
+		sprintf(directive, "#line 1 %d\n", (int)files.size());
+		source += directive + preprocessShader(line.substr(open+1, close-open-1).c_str(), files, depth+1);
+		sprintf(directive, "#line %d %d\n", number+1, index);
+		source += directive;
+	}
+	return source;
+}
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
+/* Full source of one variant - includes expanded and the feature #defines injected
+   after the #version line. files gets the name of every file read */
+string expandShader (const char* path, unsigned features, vector<string>& files)
+{
+	string source = preprocessShader(path, files);
+	string defines;
+	for (int i = 0; i < SHADER_FEATURES; i++)
+		if (features & (1<<i))
+			defines += string("#define ") + shader_feature_defines[i] + "\n";
+	size_t version = source.find("#version");
+	size_t line_end = version==string::npos ? string::npos : source.find('\n', version);
+	if (line_end!=string::npos && !defines.empty())
+		source.insert(line_end+1, defines + "#line 2 0\n");
+	return source;
+}
+
+/* Compile one stage, logging only when the driver complains */
+GLuint compileShader (GLenum type, const vector<string>& files, const string& source)
+{
+	GLuint ShaderID = glCreateShader(type);
+	char const * SourcePointer = source.c_str();
+	glShaderSource(ShaderID, 1, &SourcePointer, NULL);
+	glCompileShader(ShaderID);
+
+	GLint Result = GL_FALSE;
+	glGetShaderiv(ShaderID, GL_COMPILE_STATUS, &Result);
+	if (Result!=GL_TRUE)
 	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
+		int InfoLogLength;
+		glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+		std::vector<char> ShaderErrorMessage( max(InfoLogLength, int(1)) );
+		glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+		cout << "Error compiling shader " << files[0] << ":";
+		for (size_t i = 1; i < files.size(); i++)
+			cout << " " << i << " = " << files[i];
+		cout << endl << ShaderErrorMessage.data() << endl;
 	}
+	return ShaderID;
+}
+
+/* Program binary cache file - the header, then the driver's binary */
+struct ProgramCacheHeader {
+	char magic[4];
+	unsigned int version;
+	unsigned long long key;
+	GLenum format;
+	GLint length;
+};
+const char program_cache_magic[4] = {'V','P','R','G'};
+const unsigned int program_cache_version = 1;
+
+struct ProgramCache {
+	int supported; // -1 until the driver has been asked
+	unsigned long long driver; // hash of vendor, renderer and version - binaries only fit the driver that made them
+	int loaded, compiled;
+} program_cache = {-1, 0, 0, 0};
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+bool programCacheSupported ()
+{
+	if (program_cache.supported<0)
+	{
+		GLint formats = 0;
+		if (GLAD_GL_ARB_get_program_binary)
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		program_cache.supported = formats>0;
+		program_cache.driver = hashBytes("", 0);
+		GLenum strings[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+		for (int i = 0; i < 3; i++)
+		{
+			const char* value = (const char*)glGetString(strings[i]);
+			program_cache.driver = hashBytes(value, strlen(value)+1, program_cache.driver);
+		}
 	}
+	return program_cache.supported;
+}
 
+/* Returns 0 when there is no binary or the driver rejects it */
+GLuint loadProgramBinary (const string& path, unsigned long long key)
+{
+	ifstream file(path.c_str(), ios::in|ios::binary);
+	ProgramCacheHeader header;
+	if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, program_cache_magic, 4)!=0 || header.version!=program_cache_version || header.key!=key || header.length<=0)
+		return 0;
+	vector<char> binary(header.length);
+	if (!file.read(&binary[0], header.length))
+		return 0;
+	GLuint ProgramID = glCreateProgram();
+	glProgramBinary(ProgramID, header.format, &binary[0], header.length);
 	GLint Result = GL_FALSE;
-	int InfoLogLength;
-
-	// Compile Vertex Shader
-	cout << "Compiling shader : " <<  vertex_file_path << endl;
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-	glCompileShader(VertexShaderID);
-
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage( max(InfoLogLength, int(1)) );
-	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	cout << VertexShaderErrorMessage.data() << endl;
-
-	// Compile Fragment Shader
-	cout << "Compiling shader : " << fragment_file_path << endl;
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
-
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage( max(InfoLogLength, int(1)) );
-	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	cout << FragmentShaderErrorMessage.data() << endl;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if (Result!=GL_TRUE)
+	{
+		glDeleteProgram(ProgramID);
+		return 0;
+	}
+	return ProgramID;
+}
+
+void saveProgramBinary (const string& path, unsigned long long key, GLuint ProgramID)
+{
+	ProgramCacheHeader header;
+	memcpy(header.magic, program_cache_magic, 4);
+	header.version = program_cache_version;
+	header.key = key;
+	glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &header.length);
+	if (header.length<=0)
+		return;
+	vector<char> binary(header.length);
+	glGetProgramBinary(ProgramID, header.length, NULL, &header.format, &binary[0]);
+	mkdir(cache_directory, 0755);
+	string partial = path+".part";
+	ofstream file(partial.c_str(), ios::out|ios::binary|ios::trunc);
+	file.write((const char*)&header, sizeof(header));
+	file.write(&binary[0], header.length);
+	file.close();
+	if (file.fail() || rename(partial.c_str(), path.c_str())!=0)
+		remove(partial.c_str());
+}
+
+/* Build a program from a vertex and a fragment shader, specialized on features -
+   from the binary cache when the sources and the driver are unchanged, compiling
+   and linking otherwise */
+ProgramHandle LoadShaders(const char * vertex_file_path,const char * fragment_file_path,unsigned features=0) {
+
+	vector<string> VertexShaderFiles, FragmentShaderFiles;
+	std::string VertexShaderCode = expandShader(vertex_file_path, features, VertexShaderFiles);
+	std::string FragmentShaderCode = expandShader(fragment_file_path, features, FragmentShaderFiles);
+
+	GLuint ProgramID = 0;
+	bool cached = programCacheSupported();
+	unsigned long long key = hashBytes(VertexShaderCode.data(), VertexShaderCode.size(), program_cache.driver);
+	key = hashBytes(FragmentShaderCode.data(), FragmentShaderCode.size()+1, key);
+	string path = cachePath("program", key, "bin");
+	if (cached)
+		ProgramID = loadProgramBinary(path, key);
+	if (ProgramID)
+	{
+		program_cache.loaded++;
+		return ProgramHandle::adopt(ProgramID);
+	}
+
+	GLuint VertexShaderID = compileShader(GL_VERTEX_SHADER, VertexShaderFiles, VertexShaderCode);
+	GLuint FragmentShaderID = compileShader(GL_FRAGMENT_SHADER, FragmentShaderFiles, FragmentShaderCode);
 
 	// Link the program
-	cout << "Linking program" << endl;
-	GLuint ProgramID = glCreateProgram();
+	ProgramID = glCreateProgram();
 	glAttachShader(ProgramID, VertexShaderID);
 	glAttachShader(ProgramID, FragmentShaderID);
+	if (cached)
+		glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(ProgramID);
 
 	// Check the program
+	GLint Result = GL_FALSE;
 	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-	cout << ProgramErrorMessage.data() << endl;
+	if (Result!=GL_TRUE)
+	{
+		int InfoLogLength;
+		glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+		std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
+		glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+		cout << "Error linking " << vertex_file_path << " with " << fragment_file_path << ":" << endl << ProgramErrorMessage.data() << endl;
+	}
+	else if (cached)
+		saveProgramBinary(path, key, ProgramID);
 
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
+	program_cache.compiled++;
 
-	return ProgramID;
+	return ProgramHandle::adopt(ProgramID);
 }
 
 static void error_callback(int error, const char* description)
@@ -130,8 +499,16 @@ static void error_callback(int error, const char* description)
 	cout << "Error: " << description << endl;
 }
 
+int quit_requested = 0; // set by quit when headless, ends the tick loop
+
 void quit(GLFWwindow *window)
 {
+	if (window==NULL)
+	{
+		// Headless - there is nothing to close, finish the tick and let runHeadless report
+		quit_requested = 1;
+		return;
+	}
 	glfwDestroyWindow(window);
 	glfwTerminate();
 	exit(EXIT_SUCCESS);
@@ -157,184 +534,829 @@ glm::vec3 getRGBfromHue (int hue)
 		return glm::vec3(1,0,x);
 }
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+/* Record value as the current state; returns whether the GL call has to be made */
+int updateGLState (GLuint &current, GLuint value)
+{
+	if (current==value)
+	{
+		gl_state.elided++;
+		return 0;
+	}
+	current = value;
+	gl_state.issued++;
+	return 1;
+}
+
+void useProgram (GLuint program)
+{
+	if (updateGLState(gl_state.program, program))
+		glUseProgram(program);
+}
+
+void bindVertexArray (GLuint vertex_array)
+{
+	if (updateGLState(gl_state.vertex_array, vertex_array))
+		glBindVertexArray(vertex_array);
+}
+
+void bindTexture (GLuint texture)
+{
+	if (updateGLState(gl_state.texture, texture))
+		glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+void polygonMode (GLenum mode)
+{
+	if (updateGLState(gl_state.polygon_mode, mode))
+		glPolygonMode(GL_FRONT_AND_BACK, mode);
+}
+
+/* Enable a vertex attribute of the bound VAO - enables are VAO state, so they are tracked per VAO */
+void enableVertexAttrib (struct VAO* vao, GLuint index)
+{
+	if (vao->EnabledAttributes & (1u<<index))
+	{
+		gl_state.elided++;
+		return;
+	}
+	vao->EnabledAttributes |= 1u<<index;
+	gl_state.issued++;
+	glEnableVertexAttribArray(index);
+}
+
+/* Close the frame's call counts, reported by reportGLState */
+void endGLStateFrame ()
+{
+	gl_state.last_issued = gl_state.issued;
+	gl_state.last_elided = gl_state.elided;
+	gl_state.issued = gl_state.elided = 0;
+}
+
+void reportGLState ()
+{
+	cout<<"GL state: "<<gl_state.last_elided<<" of "<<gl_state.last_issued+gl_state.last_elided<<" calls elided last frame"<<endl;
+}
+
+/* Vertex as the mesh builders produce it: position, RGBA8 colour, and a texture
+   coordinate for textured meshes or a bone index for skinned ones */
+struct Vertex {
+	GLfloat position[3];
+	GLubyte color[4];
+	union {
+		GLfloat uv[2];
+		GLfloat bone;
+	};
+};
+
+/* Vertex as it is stored on the GPU - the position quantized to int16 against the
+   mesh's PositionScale. Only the bytes the layout uses are uploaded */
+struct PackedVertex {
+	GLshort position[4]; // w is padding
+	GLubyte color[4];
+	union {
+		GLfloat uv[2];
+		GLfloat bone;
+	};
+};
+
+enum { VERTEX_COLORED, VERTEX_TEXTURED, VERTEX_SKINNED };
+const int vertex_strides[] = {12, 20, 16};
+const int unpacked_strides[] = {24, 20, 28}; // separate float VBOs, as meshes were stored before
+
+Vertex makeVertex (const GLfloat* position, const GLfloat* color)
+{
+	Vertex v;
+	memset(&v, 0, sizeof(v));
+	for (int k = 0; k < 3; k++)
+	{
+		v.position[k] = position[k];
+		v.color[k] = color ? (GLubyte)(min(max(color[k],0.0f),1.0f)*255+0.5f) : 255;
+	}
+	v.color[3] = 255;
+	return v;
+}
+
+/* A mesh through the pipeline: quantized, welded and cache ordered */
+struct PackedMesh {
+	vector<GLubyte> vertices;
+	vector<GLushort> indices;
+	float scale; // position = quantized position * scale
+	float welded_acmr; // cache miss ratio in the builder's triangle order
+};
+
+const int vertex_cache_size = 32;
+
+/* Average cache miss ratio - vertices transformed per triangle, on an LRU cache */
+float meshACMR (const vector<GLushort>& indices)
+{
+	if (indices.size()<3)
+		return 0;
+	vector<int> cache;
+	int misses = 0;
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		vector<int>::iterator hit = find(cache.begin(), cache.end(), indices[i]);
+		if (hit==cache.end())
+			misses++;
+		else
+			cache.erase(hit);
+		cache.insert(cache.begin(), indices[i]);
+		if ((int)cache.size()>vertex_cache_size)
+			cache.pop_back();
+	}
+	return misses/(indices.size()/3.0f);
+}
+
+/* Score of a vertex for Forsyth's optimizer - recently used vertices and ones with
+   few triangles left are preferred */
+float vertexCacheScore (int cache_position, int triangles_left)
+{
+	if (triangles_left==0)
+		return -1;
+	float score = 0;
+	if (cache_position>=0)
+		score = cache_position<3 ? 0.75f : pow(1-(cache_position-3)/(float)(vertex_cache_size-3), 1.5f);
+	return score + 2.0f/sqrt((float)triangles_left);
+}
+
+/* Reorder triangles for the post-transform vertex cache (Tom Forsyth's linear-speed optimizer) */
+void optimizeVertexCache (vector<GLushort>& indices, int numVertices)
+{
+	int numTriangles = indices.size()/3;
+	vector< vector<int> > vertex_triangles(numVertices);
+	for (int t = 0; t < numTriangles; t++)
+		for (int k = 0; k < 3; k++)
+			vertex_triangles[indices[3*t+k]].push_back(t);
+	vector<int> cache_position(numVertices, -1);
+	vector<float> vertex_score(numVertices);
+	for (int v = 0; v < numVertices; v++)
+		vertex_score[v] = vertexCacheScore(-1, vertex_triangles[v].size());
+	vector<float> triangle_score(numTriangles, 0);
+	for (int t = 0; t < numTriangles; t++)
+		for (int k = 0; k < 3; k++)
+			triangle_score[t] += vertex_score[indices[3*t+k]];
+	vector<char> emitted(numTriangles, 0);
+	vector<GLushort> ordered;
+	vector<int> cache;
+	int best = -1;
+	for (int n = 0; n < numTriangles; n++)
+	{
+		if (best<0)
+			for (int t = 0; t < numTriangles; t++)
+				if (!emitted[t] && (best<0 || triangle_score[t]>triangle_score[best]))
+					best = t;
+		emitted[best] = 1;
+		for (int k = 0; k < 3; k++)
+		{
+			int v = indices[3*best+k];
+			ordered.push_back(v);
+			vector<int> &left = vertex_triangles[v];
+			left.erase(find(left.begin(), left.end(), best));
+			vector<int>::iterator cached = find(cache.begin(), cache.end(), v);
+			if (cached!=cache.end())
+				cache.erase(cached);
+			cache.insert(cache.begin(), v);
+		}
+		// Rescore everything in the cache, and whatever just fell out of it
+		for (size_t i = 0; i < cache.size(); i++)
+		{
+			int v = cache[i];
+			cache_position[v] = i<(size_t)vertex_cache_size ? i : -1;
+			float score = vertexCacheScore(cache_position[v], vertex_triangles[v].size());
+			for (size_t j = 0; j < vertex_triangles[v].size(); j++)
+				triangle_score[vertex_triangles[v][j]] += score-vertex_score[v];
+			vertex_score[v] = score;
+		}
+		if ((int)cache.size()>vertex_cache_size)
+			cache.resize(vertex_cache_size);
+		best = -1;
+		for (size_t i = 0; i < cache.size(); i++)
+			for (size_t j = 0; j < vertex_triangles[cache[i]].size(); j++)
+			{
+				int t = vertex_triangles[cache[i]][j];
+				if (best<0 || triangle_score[t]>triangle_score[best])
+					best = t;
+			}
+	}
+	indices.swap(ordered);
+}
+
+/* Mesh pipeline: quantize positions to int16 against a power of two scale (so
+   coordinates on the game's half-unit grid stay exact), weld identical vertices,
+   reorder triangles for the vertex cache and vertices in order of first use */
+void packMesh (const vector<Vertex>& vertices, int layout, GLenum primitive_mode, PackedMesh& out)
+{
+	int stride = vertex_strides[layout];
+	float extent = 0;
+	for (size_t i = 0; i < vertices.size(); i++)
+		for (int k = 0; k < 3; k++)
+			extent = max(extent, fabs(vertices[i].position[k]));
+	out.scale = extent>0 ? exp2(ceil(log2(extent/32767))) : 1;
+	out.welded_acmr = 0;
+	out.vertices.clear();
+	out.indices.clear();
+	map<string,GLushort> welded;
+	vector<string> distinct;
+	vector<GLushort> indices;
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		PackedVertex p;
+		memset(&p, 0, sizeof(p));
+		for (int k = 0; k < 3; k++)
+			p.position[k] = (GLshort)floor(vertices[i].position[k]/out.scale+0.5f);
+		memcpy(p.color, vertices[i].color, sizeof(p.color));
+		memcpy(p.uv, vertices[i].uv, sizeof(p.uv));
+		string bytes((const char*)&p, stride);
+		map<string,GLushort>::iterator found = welded.find(bytes);
+		if (found==welded.end())
+		{
+			if (welded.size()>0xffff)
+			{
+				// 16 bit indices cannot reach the rest - leave the mesh empty rather than draw part of it
+				cout<<"Mesh of "<<vertices.size()<<" vertices has more than 65536 distinct ones, not uploaded"<<endl;
+				return;
+			}
+			found = welded.insert(make_pair(bytes, (GLushort)welded.size())).first;
+			distinct.push_back(bytes);
+		}
+		indices.push_back(found->second);
+	}
+	out.welded_acmr = meshACMR(indices);
+	if (primitive_mode==GL_TRIANGLES)
+		optimizeVertexCache(indices, distinct.size());
+	vector<int> remap(distinct.size(), -1);
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		if (remap[indices[i]]<0)
+		{
+			remap[indices[i]] = out.vertices.size()/stride;
+			out.vertices.insert(out.vertices.end(), distinct[indices[i]].begin(), distinct[indices[i]].end());
+		}
+		out.indices.push_back(remap[indices[i]]);
+	}
+}
+
+/* Meshes created so far */
+unsigned meshes_created=0;
+
+/* Upload a packed mesh into the VAO's interleaved VBO and its index buffer */
+void uploadMesh (struct VAO* vao, const PackedMesh& mesh, GLenum usage)
+{
+	vao->NumVertices = mesh.vertices.size()/vertex_strides[vao->Layout];
+	vao->NumIndices = mesh.indices.size();
+	vao->PositionScale = mesh.scale;
+	bindVertexArray (vao->VertexArrayID); // the index buffer binding is VAO state
+	bufferData (vao->VertexBuffer, GL_ARRAY_BUFFER, mesh.vertices.size(), mesh.vertices.empty() ? NULL : &mesh.vertices[0], usage);
+	bufferData (vao->IndexBuffer, GL_ELEMENT_ARRAY_BUFFER, mesh.indices.size()*sizeof(GLushort), mesh.indices.empty() ? NULL : &mesh.indices[0], usage);
+}
+
+/* Static meshes built by initGL, by their packed geometry - identical ones share GPU storage */
+struct MeshRegistry {
+	int open;
+	map<string,VAO*> meshes;
+} mesh_registry;
+
+/* Generate VAO, VBO and index buffer for interleaved vertices and return VAO handle */
+struct VAO* createMesh (GLenum primitive_mode, int layout, const vector<Vertex>& vertices, GLenum fill_mode=GL_FILL, GLenum usage=GL_STATIC_DRAW)
 {
-	struct VAO* vao = new struct VAO;
+	struct VAO* vao = new struct VAO();
 	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
 	vao->FillMode = fill_mode;
+	vao->Layout = layout;
+	int stride = vertex_strides[layout];
+	PackedMesh mesh;
+	packMesh(vertices, layout, primitive_mode, mesh);
+
+	string key;
+	if (mesh_registry.open && usage==GL_STATIC_DRAW)
+	{
+		GLenum header[3] = {primitive_mode, fill_mode, (GLenum)layout};
+		key.append((const char*)header, sizeof(header));
+		key.append((const char*)&mesh.scale, sizeof(mesh.scale));
+		key.append(mesh.vertices.begin(), mesh.vertices.end());
+		if (!mesh.indices.empty())
+			key.append((const char*)&mesh.indices[0], mesh.indices.size()*sizeof(GLushort));
+		map<string,VAO*>::iterator found = mesh_registry.meshes.find(key);
+		if (found!=mesh_registry.meshes.end())
+		{
+			VAO* shared = found->second;
+			vao->MeshID = shared->MeshID;
+			vao->VertexArrayID = shared->VertexArrayID;
+			vao->VertexBuffer = shared->VertexBuffer;
+			vao->IndexBuffer = shared->IndexBuffer;
+			vao->NumVertices = shared->NumVertices;
+			vao->NumIndices = shared->NumIndices;
+			vao->PositionScale = shared->PositionScale;
+			cout<<"Mesh "<<vao->MeshID<<": "<<vertices.size()<<" vertices, "<<vertices.size()*unpacked_strides[layout]<<" bytes -> shared"<<endl;
+			return vao;
+		}
+	}
+	vao->MeshID = ++meshes_created;
 
 	// Create Vertex Array Object
 	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+	vao->VertexArrayID = genVertexArray(); // VAO
+	vao->VertexBuffer = genBuffer(); // VBO - interleaved vertices
+	vao->IndexBuffer = genBuffer(); // IBO - indices
 
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+	uploadMesh(vao, mesh, usage); // Binds the VAO and copies the vertices and indices
+	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
 	glVertexAttribPointer(
 						  0,                  // attribute 0. Vertices
 						  3,                  // size (x,y,z)
-						  GL_FLOAT,           // type
+						  GL_SHORT,           // type
 						  GL_FALSE,           // normalized?
-						  0,                  // stride
+						  stride,             // stride
 						  (void*)0            // array buffer offset
 						  );
-
-	glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
 	glVertexAttribPointer(
 						  1,                  // attribute 1. Color
-						  3,                  // size (r,g,b)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
+						  4,                  // size (r,g,b,a)
+						  GL_UNSIGNED_BYTE,   // type
+						  GL_TRUE,            // normalized?
+						  stride,             // stride
+						  (void*)8            // array buffer offset
 						  );
+	if (layout==VERTEX_TEXTURED)
+		glVertexAttribPointer(
+							  2,                  // attribute 2. Textures
+							  2,                  // size (s,t)
+							  GL_FLOAT,           // type
+							  GL_FALSE,           // normalized?
+							  stride,             // stride
+							  (void*)12           // array buffer offset
+							  );
+	if (layout==VERTEX_SKINNED)
+	{
+		glVertexAttribPointer(
+							  3,                  // attribute 3. Bone index
+							  1,                  // size (bone)
+							  GL_FLOAT,           // type
+							  GL_FALSE,           // normalized?
+							  stride,             // stride
+							  (void*)12           // array buffer offset
+							  );
+		enableVertexAttrib(vao, 3);
+	}
 
+	if (mesh_registry.open && usage==GL_STATIC_DRAW)
+	{
+		mesh_registry.meshes[key] = vao;
+		cout<<"Mesh "<<vao->MeshID<<": "<<vertices.size()<<" vertices, "<<vertices.size()*unpacked_strides[layout]<<" bytes -> "
+			<<vao->NumVertices<<" vertices, "<<mesh.vertices.size()+mesh.indices.size()*sizeof(GLushort)<<" bytes, ACMR "<<mesh.welded_acmr<<" -> "<<meshACMR(mesh.indices)<<endl;
+	}
 	return vao;
 }
 
+/* Meshes built from here on are checked for shared geometry and reported */
+void openMeshRegistry ()
+{
+	mesh_registry.open = 1;
+}
+
+void closeMeshRegistry ()
+{
+	mesh_registry.open = 0;
+	mesh_registry.meshes.clear();
+}
+
+/* Generate VAO, VBOs and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+{
+	vector<Vertex> vertices;
+	for (int i = 0; i < numVertices; i++)
+		vertices.push_back(makeVertex(&vertex_buffer_data[3*i], &color_buffer_data[3*i]));
+	return createMesh(primitive_mode, VERTEX_COLORED, vertices, fill_mode);
+}
+
 /* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-	GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-	for (int i=0; i<numVertices; i++) {
-		color_buffer_data [3*i] = red;
-		color_buffer_data [3*i + 1] = green;
-		color_buffer_data [3*i + 2] = blue;
+	GLfloat color[3] = {red, green, blue};
+	vector<Vertex> vertices;
+	for (int i = 0; i < numVertices; i++)
+		vertices.push_back(makeVertex(&vertex_buffer_data[3*i], color));
+	return createMesh(primitive_mode, VERTEX_COLORED, vertices, fill_mode);
+}
+
+struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, const TextureHandle& textureID, GLenum fill_mode=GL_FILL)
+{
+	vector<Vertex> vertices;
+	for (int i = 0; i < numVertices; i++)
+	{
+		Vertex v = makeVertex(&vertex_buffer_data[3*i], NULL);
+		v.uv[0] = texture_buffer_data[2*i];
+		v.uv[1] = texture_buffer_data[2*i+1];
+		vertices.push_back(v);
 	}
+	struct VAO* vao = createMesh(primitive_mode, VERTEX_TEXTURED, vertices, fill_mode);
+	vao->TextureID = textureID;
+	vao->AtlasRect = glm::vec4(0,0,1,1);
+	return vao;
+}
 
-	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+/* Colored object whose vertices each follow one bone matrix of the skinned shader */
+struct VAO* createSkinnedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, const GLfloat* bone_buffer_data, GLenum fill_mode=GL_FILL)
+{
+	vector<Vertex> vertices;
+	for (int i = 0; i < numVertices; i++)
+	{
+		Vertex v = makeVertex(&vertex_buffer_data[3*i], &color_buffer_data[3*i]);
+		v.bone = bone_buffer_data[i];
+		vertices.push_back(v);
+	}
+	return createMesh(primitive_mode, VERTEX_SKINNED, vertices, fill_mode);
 }
 
-struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, GLuint textureID, GLenum fill_mode=GL_FILL)
+/* Colored object whose geometry changes at runtime - see updateDynamicObject */
+struct VAO* createDynamicObject (GLenum primitive_mode, GLenum fill_mode=GL_FILL)
 {
-	struct VAO* vao = new struct VAO;
-	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
-	vao->FillMode = fill_mode;
-	vao->TextureID = textureID;
+	return createMesh(primitive_mode, VERTEX_COLORED, vector<Vertex>(), fill_mode, GL_STREAM_DRAW);
+}
 
-	// Create Vertex Array Object
-	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->TextureBuffer));  // VBO - textures
+/* Stream new geometry into a dynamic object. Respecifying the storage orphans the
+   old one, so the driver can hand out fresh memory instead of waiting on draws still using it */
+void updateDynamicObject (struct VAO* vao, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data)
+{
+	vector<Vertex> vertices;
+	for (int i = 0; i < numVertices; i++)
+		vertices.push_back(makeVertex(&vertex_buffer_data[3*i], &color_buffer_data[3*i]));
+	PackedMesh mesh;
+	packMesh(vertices, vao->Layout, vao->PrimitiveMode, mesh);
+	uploadMesh(vao, mesh, GL_STREAM_DRAW);
+}
 
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
-	glVertexAttribPointer(
-						  0,                  // attribute 0. Vertices
-						  3,                  // size (x,y,z)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
+/* Triple-buffered stream buffer. Each frame writes its own region through an
+   unsynchronized map, and a fence per region tells when the GPU is done reading
+   it, so the CPU only waits if it gets three frames ahead */
+const int RING_REGIONS = 3;
+
+struct RingBuffer {
+	BufferHandle Buffer;
+	GLsizeiptr region_size;
+	int region; // region of the frame being written
+	GLsync fences[RING_REGIONS];
+	int stalls; // times a region was still in use when its turn came
+};
 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->TextureBuffer); // Bind the VBO textures
-	glBufferData (GL_ARRAY_BUFFER, 2*numVertices*sizeof(GLfloat), texture_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
-	glVertexAttribPointer(
-						  2,                  // attribute 2. Textures
-						  2,                  // size (s,t)
-						  GL_FLOAT,           // type
-						  GL_FALSE,           // normalized?
-						  0,                  // stride
-						  (void*)0            // array buffer offset
-						  );
+/* Map room for size bytes in this frame's region; offset is where it starts in the buffer */
+void* mapRingRegion (RingBuffer& ring, GLsizeiptr size, GLintptr& offset)
+{
+	if (ring.Buffer==0 || size>ring.region_size)
+	{
+		// Grow - fresh storage, so nothing in flight needs waiting for
+		ring.region_size = max(size, 2*ring.region_size);
+		if (ring.Buffer==0)
+			ring.Buffer = genBuffer();
+		bufferData(ring.Buffer, GL_ARRAY_BUFFER, RING_REGIONS*ring.region_size, NULL, GL_STREAM_DRAW);
+		for (int i = 0; i < RING_REGIONS; i++)
+			if (ring.fences[i])
+			{
+				glDeleteSync(ring.fences[i]);
+				ring.fences[i] = 0;
+			}
+	}
+	GLsync &fence = ring.fences[ring.region];
+	if (fence)
+	{
+		if (glClientWaitSync(fence, 0, 0)==GL_TIMEOUT_EXPIRED)
+		{
+			ring.stalls++;
+			glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+		}
+		glDeleteSync(fence);
+		fence = 0;
+	}
+	offset = ring.region*ring.region_size;
+	glBindBuffer(GL_ARRAY_BUFFER, ring.Buffer);
+	return glMapBufferRange(GL_ARRAY_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+}
 
-	return vao;
+/* Returns 0 if the region's contents were lost while mapped (e.g. a mode switch) */
+int unmapRingRegion (RingBuffer& ring)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, ring.Buffer);
+	return glUnmapBuffer(GL_ARRAY_BUFFER)==GL_TRUE;
+}
+
+/* Fence this frame's region after the draws reading it, and move to the next one */
+void fenceRingRegion (RingBuffer& ring)
+{
+	ring.fences[ring.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	ring.region = (ring.region+1)%RING_REGIONS;
+}
+
+/* Release an object created above - its VBOs and VAO go at the next frame boundary */
+void delete3DObject (struct VAO* vao)
+{
+	delete vao;
 }
 
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao)
 {
 	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+	polygonMode (vao->FillMode);
 
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+	// Bind the VAO to use - it already knows its VBOs
+	bindVertexArray (vao->VertexArrayID);
 
 	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+	enableVertexAttrib(vao, 0);
 
 	// Enable Vertex Attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+	enableVertexAttrib(vao, 1);
 
 	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+	glDrawElements(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_SHORT, (void*)0);
 }
 
-void draw3DTexturedObject (struct VAO* vao)
-{
-	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+/* An image decoded off the GL thread */
+struct DecodedImage {
+	const char* filename;
+	int width, height;
+	unsigned char* pixels; // RGB, NULL if decoding failed
+	double seconds;
+};
 
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+/* Decodes a batch of images on a pool of worker threads, so startup waits on the
+   slowest image rather than the sum of them - and the GL thread is free meanwhile */
+struct ImageLoader {
+	vector<DecodedImage> images;
+	atomic<int> next;
+	vector<thread> workers;
+	double started;
+} image_loader;
 
-	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+void decodeImages (ImageLoader* loader)
+{
+	for (int i = loader->next++; i < (int)loader->images.size(); i = loader->next++)
+	{
+		DecodedImage& image = loader->images[i];
+		double start = glfwGetTime();
+		image.pixels = SOIL_load_image(image.filename, &image.width, &image.height, 0, SOIL_LOAD_RGB);
+		if (image.pixels==NULL)
+			image.width = image.height = 0;
+		image.seconds = glfwGetTime()-start;
+	}
+}
 
-	// Bind Textures using texture units
-	glBindTexture(GL_TEXTURE_2D, vao->TextureID);
+void startImageLoads (ImageLoader& loader, const char* filenames[], int count)
+{
+	loader.images.resize(count);
+	for (int i = 0; i < count; i++)
+		loader.images[i].filename = filenames[i];
+	loader.next = 0;
+	loader.started = glfwGetTime();
+	int threads = min(count, max(1, (int)thread::hardware_concurrency()));
+	for (int i = 0; i < threads; i++)
+		loader.workers.push_back(thread(decodeImages, &loader));
+}
 
-	// Enable Vertex Attribute 2 - Texture
-	glEnableVertexAttribArray(2);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->TextureBuffer);
+/* Wait for every image of the batch. Workers are gone afterwards, the pixels stay
+   until freeImageLoads */
+void finishImageLoads (ImageLoader& loader)
+{
+	int threads = loader.workers.size();
+	for (int i = 0; i < threads; i++)
+		loader.workers[i].join();
+	loader.workers.clear();
+	double slowest = 0, total = 0;
+	for (int i = 0; i < (int)loader.images.size(); i++)
+	{
+		if (loader.images[i].pixels==NULL)
+			cout << "SOIL loading error: could not decode '" << loader.images[i].filename << "'" << endl;
+		slowest = max(slowest, loader.images[i].seconds);
+		total += loader.images[i].seconds;
+	}
+	cout << "Images: " << loader.images.size() << " decoded on " << threads << " threads, ready " << 1000*(glfwGetTime()-loader.started) << " ms after start (slowest " << 1000*slowest << " ms, sum " << 1000*total << " ms)" << endl;
+}
 
-	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+void freeImageLoads (ImageLoader& loader)
+{
+	for (int i = 0; i < (int)loader.images.size(); i++)
+		if (loader.images[i].pixels!=NULL)
+			SOIL_free_image_data(loader.images[i].pixels);
+	loader.images.clear();
+}
 
-	// Unbind Textures to be safe
-	glBindTexture(GL_TEXTURE_2D, 0);
+/* Copy the images to their places in a tightly packed RGB atlas, clearing the gutters */
+void composeAtlas (const vector<DecodedImage>& images, const vector<int>& xs, const vector<int>& ys, int atlas_width, int atlas_height, GLubyte* atlas_pixels)
+{
+	memset(atlas_pixels, 0, 3*atlas_width*atlas_height);
+	for (int i = 0; i < (int)images.size(); i++)
+		for (int row = 0; row < images[i].height; row++)
+			memcpy(atlas_pixels+3*((ys[i]+row)*atlas_width+xs[i]), images[i].pixels+3*row*images[i].width, 3*images[i].width);
 }
 
-/* Create an OpenGL Texture from an image */
-GLuint createTexture (const char* filename)
+/* Pack decoded images into one texture - shelf packing, tallest first, with a
+   gutter so mipmaps do not bleed between neighbours. The atlas is composed in a
+   pixel buffer and uploaded from it. regions gets the UV rectangle of each image
+   as u, v, width, height */
+TextureHandle createAtlas (const vector<DecodedImage>& images, glm::vec4 regions[], int atlas_width=1024)
 {
-	GLuint TextureID;
-	// Generate Texture Buffer
-	glGenTextures(1, &TextureID);
-	// All upcoming GL_TEXTURE_2D operations now have effect on our texture buffer
-	glBindTexture(GL_TEXTURE_2D, TextureID);
-	// Set our texture parameters
-	// Set texture wrapping to GL_REPEAT
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	// Set texture filtering (interpolation)
+	const int gutter = 4;
+	int count = images.size();
+	vector<int> xs(count), ys(count), order;
+	for (int i = 0; i < count; i++)
+		order.push_back(i);
+	for (int i = 1; i < count; i++)
+		for (int j = i; j > 0 && images[order[j]].height>images[order[j-1]].height; j--)
+			swap(order[j], order[j-1]);
+	// Widen the atlas for an image that would not fit on any shelf
+	for (int i = 0; i < count; i++)
+		while (atlas_width<images[i].width)
+			atlas_width *= 2;
+	int x = 0, y = 0, shelf = 0;
+	for (int k = 0; k < count; k++)
+	{
+		int i = order[k];
+		if (x+images[i].width>atlas_width)
+		{
+			y += shelf+gutter;
+			x = shelf = 0;
+		}
+		xs[i] = x;
+		ys[i] = y;
+		x += images[i].width+gutter;
+		shelf = max(shelf, images[i].height);
+	}
+	int atlas_height = 1;
+	while (atlas_height<y+shelf)
+		atlas_height *= 2;
+
+	// Compose the atlas straight into a pixel buffer - rows are tightly packed RGB
+	GLsizeiptr size = 3*atlas_width*atlas_height;
+	BufferHandle pixels = genBuffer();
+	bufferData(pixels, GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+	GLubyte* atlas_pixels = (GLubyte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+	int mapped = atlas_pixels!=NULL;
+	if (mapped)
+	{
+		composeAtlas(images, xs, ys, atlas_width, atlas_height, atlas_pixels);
+		mapped = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER)==GL_TRUE;
+	}
+	vector<GLubyte> client_pixels;
+	if (!mapped)
+	{
+		// The buffer could not be mapped, or lost its contents - upload from client memory instead
+		cout << "Sprite atlas: pixel buffer unavailable, uploading from client memory" << endl;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		client_pixels.resize(size);
+		composeAtlas(images, xs, ys, atlas_width, atlas_height, &client_pixels[0]);
+	}
+	long used = 0;
+	for (int i = 0; i < count; i++)
+	{
+		regions[i] = glm::vec4(xs[i]/(float)atlas_width, ys[i]/(float)atlas_height, images[i].width/(float)atlas_width, images[i].height/(float)atlas_height);
+		used += images[i].width*images[i].height;
+	}
+
+	TextureHandle atlas = genTexture();
+	bindTexture(atlas);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // RGB rows of odd widths are not 4 byte aligned
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, atlas_width, atlas_height, 0, GL_RGB, GL_UNSIGNED_BYTE, mapped ? NULL : &client_pixels[0]); // NULL - from the bound pixel buffer
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	atlas.setBytes(4*atlas_width*atlas_height); // RGB8, plus a third again for the mip chain
+	bindTexture(0);
+	cout << "Sprite atlas: " << count << " images in " << atlas_width << "x" << atlas_height << ", " << 100.0*used/(atlas_width*atlas_height) << "% occupied" << endl;
+	return atlas;
+}
 
-	// Load image and create OpenGL texture
-	int twidth, theight;
-	unsigned char* image = SOIL_load_image(filename, &twidth, &theight, 0, SOIL_LOAD_RGB);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, twidth, theight, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-	glGenerateMipmap(GL_TEXTURE_2D); // Generate MipMaps to use
-	SOIL_free_image_data(image); // Free the data read from file after creating opengl texture
-	glBindTexture(GL_TEXTURE_2D, 0); // Unbind texture when done, so we won't accidentily mess it up
+/* Texture cache file - the header, the atlas regions, then every mip level as
+   tightly packed RGB8, largest first */
+struct TextureCacheHeader {
+	char magic[4];
+	unsigned int version;
+	unsigned long long key;
+	int width, height, levels, regions;
+};
+const char texture_cache_magic[4] = {'V','T','E','X'};
+const unsigned int texture_cache_version = 1;
 
-	return TextureID;
+long mipLevelBytes (const TextureCacheHeader& header, int level)
+{
+	return 3L*max(1, header.width>>level)*max(1, header.height>>level);
 }
 
+/* Levels of a full mip chain, down to 1x1 */
+int mipLevels (int width, int height)
+{
+	int levels = 1;
+	while ((width>>levels)>0 || (height>>levels)>0)
+		levels++;
+	return levels;
+}
+
+/* Upload a cached texture straight from the mapped file - no decoding and no
+   mipmap generation. Returns a null handle on a miss */
+TextureHandle loadTextureCache (unsigned long long key, glm::vec4 regions[], int count)
+{
+	string path = cachePath("atlas", key, "tex");
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd<0)
+		return TextureHandle();
+	struct stat info;
+	fstat(fd, &info);
+	void* mapped = info.st_size>=(off_t)sizeof(TextureCacheHeader) ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (mapped==MAP_FAILED)
+		return TextureHandle();
+
+	// Trust the sizes in the header only once it is known to be ours, and then only within limits
+	const TextureCacheHeader& header = *(const TextureCacheHeader*)mapped;
+	int valid = memcmp(header.magic, texture_cache_magic, 4)==0 && header.version==texture_cache_version && header.key==key && header.regions==count;
+	if (valid)
+	{
+		GLint max_size = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+		valid = header.width>0 && header.height>0 && header.width<=max_size && header.height<=max_size
+			&& header.levels==mipLevels(header.width, header.height);
+	}
+	if (valid)
+	{
+		long size = sizeof(TextureCacheHeader)+count*sizeof(glm::vec4);
+		for (int level = 0; level < header.levels; level++)
+			size += mipLevelBytes(header, level);
+		valid = size==info.st_size;
+	}
+	TextureHandle texture;
+	if (valid)
+	{
+		const GLubyte* data = (const GLubyte*)mapped+sizeof(TextureCacheHeader);
+		memcpy(regions, data, count*sizeof(glm::vec4));
+		data += count*sizeof(glm::vec4);
+		texture = genTexture();
+		bindTexture(texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header.levels-1);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for (int level = 0; level < header.levels; level++)
+		{
+			glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, max(1, header.width>>level), max(1, header.height>>level), 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+			data += mipLevelBytes(header, level);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		texture.setBytes(4*header.width*header.height);
+		bindTexture(0);
+		cout << "Texture cache: loaded " << path << ", " << info.st_size << " bytes" << endl;
+	}
+	munmap(mapped, info.st_size);
+	return texture;
+}
+
+/* Read back a texture with its full mip chain and store it for the next run */
+void saveTextureCache (unsigned long long key, const TextureHandle& texture, const glm::vec4 regions[], int count)
+{
+	TextureCacheHeader header;
+	memcpy(header.magic, texture_cache_magic, 4);
+	header.version = texture_cache_version;
+	header.key = key;
+	header.regions = count;
+	bindTexture(texture);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &header.width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &header.height);
+	header.levels = mipLevels(header.width, header.height);
+
+	mkdir(cache_directory, 0755);
+	string path = cachePath("atlas", key, "tex");
+	string partial = path+".part"; // renamed into place once complete, so a reader never sees half a file
+	ofstream file(partial.c_str(), ios::out|ios::binary|ios::trunc);
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)regions, count*sizeof(glm::vec4));
+	vector<GLubyte> level_pixels;
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	for (int level = 0; level < header.levels; level++)
+	{
+		level_pixels.resize(mipLevelBytes(header, level));
+		glGetTexImage(GL_TEXTURE_2D, level, GL_RGB, GL_UNSIGNED_BYTE, &level_pixels[0]);
+		file.write((const char*)&level_pixels[0], level_pixels.size());
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	bindTexture(0);
+	file.close();
+	if (file.fail() || rename(partial.c_str(), path.c_str())!=0)
+	{
+		cout << "Texture cache: could not write " << path << endl;
+		remove(partial.c_str());
+	}
+}
 
 /**************************
  * Customizable functions *
  **************************/
 
-VAO *cube,*person_body,*water,*walls,*person_leg,*person_hand,*person_eye,*person_neck,*person_head,*person_hair,*spike,*image1,*arrow_haed,*arrow_tail,*moving_block;
-VAO *coin,*background,*boat1,*boat2,*boat3,*boat4,*health,*score_cube_ver,*score_cube_hor,*fire;
+VAO *cube,*person,*water,*walls,*spike,*image1,*arrow_haed,*arrow_tail,*moving_block;
+VAO *coin,*background,*boat1,*boat2,*boat3,*boat4,*health,*fire;
 double boat_angle=0;
 double wall[5][4],no_of_walls=2;
 /*
@@ -365,8 +1387,41 @@ int l_pressed=0;
 double person_hand_angle=0,hand_angle_speed=5;
 double start1,start2,end1,end2;
 double spike_y[12][2];
-double key_angle=0,arrow_angle=0,arrow_y=0,arrow_y_direction=1;
 double moving_base[30][5],no_of_moving_base=4;
+
+/* Periodic motion the vertex shader evaluates from the animation clock - a
+   triangle wave bob along y on top of the instance's position, and a spin about y.
+   Collision evaluates the same closed forms on the CPU */
+struct Motion {
+	float amplitude; // height of the bob
+	float period; // seconds per bob cycle
+	float phase; // fraction of a cycle at time 0
+	float spin; // degrees per second
+};
+const Motion still = {0, 1, 0, 0};
+const Motion arrow_motion = {20, 4/3.0f, 0, 120};
+const Motion key_motion = {0, 1, 0, 300};
+const Motion coin_motion = {0, 1, 0, 120};
+Motion spike_motion[12], platform_motion[30];
+const double spike_low=45, spike_high=100, platform_low=60, platform_high=120.5, bob_speed=30; // units per second
+double anim_time=0;
+
+/* Bob between low and high at speed, starting at start on the way up */
+Motion bobMotion(double low,double high,double speed,double start)
+{
+	Motion m = still;
+	m.amplitude = high-low;
+	m.period = 2*m.amplitude/speed;
+	m.phase = (start-low)/m.amplitude/2;
+	return m;
+}
+
+/* Height above the instance's position at time t - matches the vertex shader */
+double bobOffset(const Motion& m,double t)
+{
+	double x = t/m.period+m.phase;
+	return m.amplitude*(1-fabs(1-2*(x-floor(x))));
+}
 double person_state,person_health=100;
 double score=0;
 int reshapeWindow_val=1,gameend=0;
@@ -502,7 +1557,6 @@ void intialize_base()
 	// empty_cube[k][0]=length_of_cube_base/2.0+(20-width_of_base/2.0)*length_of_cube_base;
 	// empty_cube[k][1]=length_of_cube_base/2.0+(21-length_of_base/2.0)*length_of_cube_base;
 	no_of_pits=k;
-	cout<<no_of_pits<<endl;
 	wall[0][0]=-300;
 	wall[0][1]=length_of_cube_base/2.0+(4-length_of_base/2.0)*length_of_cube_base;
 	wall[0][2]=length_of_cube_base*2;
@@ -529,7 +1583,7 @@ void intialize_base()
 	spike_y[10][0]=60;
 	spike_y[11][0]=50;
 	for (int i = 0; i < 12; ++i)
-		spike_y[i][1]=1;
+		spike_motion[i]=bobMotion(spike_low,spike_high,bob_speed,spike_y[i][0]);
 	moving_base[0][0]=185;
 	moving_base[0][1]=100;
 	moving_base[0][2]=200;
@@ -556,6 +1610,8 @@ void intialize_base()
 	moving_base[4][3]=1;
 	moving_base[4][4]=1;
 	no_of_moving_base=5;
+	for (int i = 0; i < no_of_moving_base; i++)
+		platform_motion[i]=bobMotion(platform_low,platform_high,bob_speed,moving_base[i][1]);
 	
 }
 
@@ -573,7 +1629,9 @@ float D2R(float A)
     return (A*M_PI)/180.0f;
 }
 
-VAO* createRectangle (GLuint textureID,double length,double width)
+/* Sprite showing the region of a texture atlas. The quad keeps 0-1 UVs so sprites
+   share one mesh and batch together - the region travels with each instance */
+VAO* createRectangle (const TextureHandle& textureID,glm::vec4 region,double length,double width)
 {
 	// GL3 accepts only Triangles. Quads are not supported
 	static const GLfloat vertex_buffer_data [] = {
@@ -609,7 +1667,9 @@ VAO* createRectangle (GLuint textureID,double length,double width)
 	};
 
 	// create3DTexturedObject creates and returns a handle to a VAO that can be used later
-	return create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+	VAO* vao = create3DTexturedObject(GL_TRIANGLES, 6, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+	vao->AtlasRect = region;
+	return vao;
 }
 
 void *play_audio(string audioFile)
@@ -892,14 +1952,67 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 	//Matrices.projection = glm::ortho(-1*(width*2/3)*1.0f, (width*2/3)*1.0f,-1*(height*2/3)*1.0f, (height*2/3)*1.0f, -1000*1.0f, 5000*1.0f);
 }
 
-VAO* createSector(float R,int parts,double clr[6][3])
+/* Triangle i of a disc of radius R cut into parts sectors, in the XY plane */
+void sectorTriangle(float R,int parts,int i,GLfloat vertex_buffer_data[9])
+{
+  float diff=360.0f/parts;
+  float A1=formatAngle(i*diff-diff/2);
+  float A2=formatAngle(i*diff+diff/2);
+  GLfloat triangle[]={0.0f,0.0f,0.0f,R*cos(D2R(A1)),R*sin(D2R(A1)),0.0f,R*cos(D2R(A2)),R*sin(D2R(A2)),0.0f};
+  for (int k = 0; k < 9; k++)
+    vertex_buffer_data[k]=triangle[k];
+}
+
+/* Procedural meshes around the y axis - level of detail lod uses 8<<lod segments */
+int lodSegments(int lod)
+{
+  return 8<<lod;
+}
+
+/* Revolve the profile (radius,y pairs from bottom to top) around the y axis.
+   Ends of the profile that are off the axis are closed with a disc of sectors. */
+void latheVertices(const vector<glm::vec2> &profile,int lod,vector<GLfloat> &vertices)
+{
+  int parts=lodSegments(lod);
+  for (int i = 0; i < parts; i++)
+  {
+    float A1=D2R(i*360.0f/parts),A2=D2R((i+1)*360.0f/parts);
+    for (size_t j = 0; j+1 < profile.size(); j++)
+    {
+      glm::vec2 p=profile[j],q=profile[j+1];
+      GLfloat quad[]={
+        p.x*cos(A1),p.y,p.x*sin(A1), p.x*cos(A2),p.y,p.x*sin(A2), q.x*cos(A2),q.y,q.x*sin(A2),
+        q.x*cos(A2),q.y,q.x*sin(A2), q.x*cos(A1),q.y,q.x*sin(A1), p.x*cos(A1),p.y,p.x*sin(A1)
+      };
+      vertices.insert(vertices.end(),quad,quad+18);
+    }
+  }
+  glm::vec2 ends[2]={profile.front(),profile.back()};
+  for (int e = 0; e < 2; e++)
+  {
+    if (ends[e].x==0)
+      continue;
+    for (int i = 0; i < parts; i++)
+    {
+      GLfloat triangle[9];
+      sectorTriangle(ends[e].x,parts,i,triangle);
+      // Lay the sector from the XY plane down onto the XZ plane at the end's height
+      for (int k = 0; k < 3; k++)
+      {
+        vertices.push_back(triangle[3*k]);
+        vertices.push_back(ends[e].y);
+        vertices.push_back(triangle[3*k+1]);
+      }
+    }
+  }
+}
+
+vector<glm::vec2> cylinderProfile(float radius,float half_height)
 {
-  float diff=360.0f/parts;
-  float A1=formatAngle(-diff/2);
-  float A2=formatAngle(diff/2);
-  GLfloat vertex_buffer_data[]={0.0f,0.0f,0.0f,R*cos(D2R(A1)),R*sin(D2R(A1)),0.0f,R*cos(D2R(A2)),R*sin(D2R(A2)),0.0f};
-  GLfloat color_buffer_data[]={clr[0][0],clr[0][1],clr[0][2],clr[1][0],clr[1][1],clr[1][2],clr[2][0],clr[2][1],clr[2][2]};
-  return create3DObject(GL_TRIANGLES,3,vertex_buffer_data,color_buffer_data,GL_FILL);
+  vector<glm::vec2> profile;
+  profile.push_back(glm::vec2(radius,-half_height));
+  profile.push_back(glm::vec2(radius,half_height));
+  return profile;
 }
 
 VAO* createTriangle(float height,float width,double clr[6][3])
@@ -939,10 +2052,10 @@ VAO* createRectangle1(double length, double breadth, double clr[6][3])
   return create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
 }
 
-VAO* createCube(GLfloat clr[108],double L,double B,double H)
+/* Box of half sizes L,H,B around the origin - front, back, left, right, top and bottom faces */
+void cubeVertices(GLfloat vertex_buffer_data[108],double L,double B,double H)
 {
-	
-	GLfloat vertex_buffer_data [] = {
+	GLfloat vertices [] = {
 		//Front Face
 		-L, -H,  B,
 		L, -H,  B,
@@ -986,6 +2099,13 @@ VAO* createCube(GLfloat clr[108],double L,double B,double H)
 		L, -H,  B,
 		-L, -H,  B
 	};
+	memcpy(vertex_buffer_data,vertices,sizeof(vertices));
+}
+
+VAO* createCube(GLfloat clr[108],double L,double B,double H)
+{
+	GLfloat vertex_buffer_data[108];
+	cubeVertices(vertex_buffer_data,L,B,H);
 	/*const GLfloat color_buffer_data [] = 
 	{
 	    clr[0][0],clr[0][1],clr[0][2], // color 1
@@ -1112,10 +2232,10 @@ VAO* createPyramid(GLfloat clr[54],double length,double height)
     return create3DObject(GL_TRIANGLES, 18, vertex_buffer_data, clr, GL_FILL);
 }
 
-VAO* createCube1(GLfloat clr[108],double L,double B,double H)
+/* Box of sizes 2L,2H,2B with a corner on the origin - same face order as cubeVertices */
+void cube1Vertices(GLfloat vertex_buffer_data[108],double L,double B,double H)
 {
-	
-	GLfloat vertex_buffer_data [] = {
+	GLfloat vertices [] = {
 		//Front Face
 		0, 0,  2*B,
 		2*L, 0,  2*B,
@@ -1159,6 +2279,13 @@ VAO* createCube1(GLfloat clr[108],double L,double B,double H)
 		2*L, 0,  2*B,
 		0, 0,  2*B
 	};
+	memcpy(vertex_buffer_data,vertices,sizeof(vertices));
+}
+
+VAO* createCube1(GLfloat clr[108],double L,double B,double H)
+{
+	GLfloat vertex_buffer_data[108];
+	cube1Vertices(vertex_buffer_data,L,B,H);
 	/*const GLfloat color_buffer_data [] = 
 	{
 	    clr[0][0],clr[0][1],clr[0][2], // color 1
@@ -1260,26 +2387,44 @@ VAO* createCube1(GLfloat clr[108],double L,double B,double H)
   	return create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, clr, GL_FILL);
 }
 
-void drawobject(VAO* obj,glm::vec3 trans,float angle,glm::vec3 rotat)
+/* Camera modes in the order the *_view flags are checked */
+enum { CAMERA_RESET, CAMERA_TOWER, CAMERA_TOP, CAMERA_NORMAL, CAMERA_HEAD, CAMERA_ADVENTURE };
+
+struct Camera {
+	int mode; // mode of the previous frame, -1 before the first one
+	glm::vec3 eye, target; // what the view matrix was built from
+	glm::vec3 from_eye, from_target; // where the running transition started
+	double transition; // 0..1 progress from the old mode to the new one
+	double time; // anim_time of the previous frame
+} camera = {-1, glm::vec3(0), glm::vec3(0), glm::vec3(0), glm::vec3(0), 0, 0};
+
+double transition_seconds=1/3.0;
+
+/* Eye and look-at point of the active camera mode */
+int cameraGoal(glm::vec3 &eye,glm::vec3 &target)
 {
 	double x,y,z,x1=0,y1=0,z1=0;
+	int mode=-1;
 	if (reset_view==1)
 	{
 		x=radius_of_camera*cos(camera_angle*M_PI/180);
 		z=-1*radius_of_camera*sin(camera_angle*M_PI/180);
 		y=camera_y;
+		mode=CAMERA_RESET;
 	}
 	if (tower_view==1)
 	{
 		x=350;
 		y=400;
 		z=350;
+		mode=CAMERA_TOWER;
 	}
 	if (top_view==1)
 	{
 		x=1;//300*cos(camera_angle*M_PI/180);
 		y=400;
 		z=0;//-300*sin(camera_angle*M_PI/180);
+		mode=CAMERA_TOP;
 	}
 	if (normal_view==1)
 	{
@@ -1289,6 +2434,7 @@ void drawobject(VAO* obj,glm::vec3 trans,float angle,glm::vec3 rotat)
 		x1=person_x;
 		y1=person_y+10+length_of_cube_base;
 		z1=person_z;
+		mode=CAMERA_NORMAL;
 	}
 	if(head_view==1)
 	{
@@ -1298,74 +2444,992 @@ void drawobject(VAO* obj,glm::vec3 trans,float angle,glm::vec3 rotat)
 		x=person_x+(length_of_cube_base)*camera_x_direction*-1;
 		y=person_y+length_of_cube_base;
 		z=person_z+length_of_cube_base*camera_z_direction*-1;
+		mode=CAMERA_HEAD;
+	}
+	if (adventure_view==1)
+	{
+		x=person_x-50*camera_x_direction*-1;//*camera_x_direction;
+		y=person_y+100;
+		z=person_z-50*camera_z_direction*-1;
+		x1=person_x;
+		y1=person_y;
+		z1=person_z;
+		mode=CAMERA_ADVENTURE;
+	}
+	eye=glm::vec3(x,y,z);
+	target=glm::vec3(x1,y1,z1);
+	return mode;
+}
+
+/* Resolve the active camera once per frame and cache view and VP in Matrices.
+   Switching modes glides from the old camera to the new one over transition_seconds
+   of game time, however often frames are drawn. */
+void updateCamera()
+{
+	glm::vec3 eye,target;
+	int mode=cameraGoal(eye,target);
+	if (camera.mode==-1)
+		camera.transition=1; // first frame - start at the goal, there is nothing to glide from
+	else if (mode!=camera.mode)
+	{
+		camera.from_eye=camera.eye;
+		camera.from_target=camera.target;
+		camera.transition=0;
+	}
+	camera.mode=mode;
+	double seconds=max(anim_time-camera.time,0.0);
+	camera.time=anim_time;
+	if (camera.transition<1)
+	{
+		camera.transition+=seconds/transition_seconds;
+		if (camera.transition>1)
+			camera.transition=1;
+		float t=camera.transition*camera.transition*(3-2*camera.transition); // smoothstep
+		eye=glm::mix(camera.from_eye,eye,t);
+		target=glm::mix(camera.from_target,target,t);
+	}
+	camera.eye=eye;
+	camera.target=target;
+	Matrices.view = glm::lookAt(eye, target, glm::vec3(0,1,0));
+	Matrices.VP = Matrices.projection * Matrices.view;
+	CameraUniforms block = {Matrices.view, Matrices.projection, Matrices.VP, (float)anim_time, {0, 0, 0}};
+	glBindBuffer(GL_UNIFORM_BUFFER, Matrices.CameraBlock);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+}
+
+/* Point a program's Camera block at the shared uniform buffer */
+void bindCameraBlock(GLuint program)
+{
+	glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Camera"), CAMERA_BLOCK_BINDING);
+}
+
+/* A draw asked for by the game logic, queued until the end of the frame */
+struct DrawPacket {
+	unsigned long long key; // program | texture | mesh, from the top bits down
+	VAO* mesh;
+	GLuint program;
+	glm::mat4 model;
+	Motion motion;
+};
+
+/* Per-instance data as the shaders read it */
+struct Instance {
+	glm::mat4 model;
+	Motion motion;
+	glm::vec4 uv_rect; // atlas region of textured meshes
+};
+
+struct RenderQueue {
+	vector<DrawPacket> packets;
+	RingBuffer Instances; // model matrices of the sorted packets, written once per frame
+	int submitted, draws; // packets and draw calls of the last flush
+} render_queue;
+
+bool packetBefore(const DrawPacket &a,const DrawPacket &b)
+{
+	return a.key<b.key;
+}
+
+/* Cheapest mesh shader variant that can draw this mesh with this motion */
+GLuint meshProgram(const VAO* mesh,const Motion& motion)
+{
+	unsigned features = 0;
+	if (mesh->Layout==VERTEX_TEXTURED)
+		features |= SHADER_TEXTURED;
+	if (motion.amplitude!=0 || motion.spin!=0)
+		features |= SHADER_ANIMATED;
+	return meshPrograms[features];
+}
+
+void submitDraw(VAO* mesh,GLuint program,glm::mat4 model,const Motion& motion)
+{
+	DrawPacket packet;
+	packet.key = ((unsigned long long)(program&0xffff)<<48) | ((unsigned long long)(mesh->TextureID&0xffff)<<32) | mesh->MeshID;
+	packet.mesh = mesh;
+	packet.program = program;
+	packet.model = model * glm::scale(glm::vec3(mesh->PositionScale));
+	packet.motion = motion;
+	render_queue.packets.push_back(packet);
+}
+
+void drawobject(VAO* obj,glm::vec3 trans,float angle,glm::vec3 rotat,const Motion& motion=still)
+{
+    glm::mat4 translatemat = glm::translate(trans);
+    glm::mat4 rotatemat = glm::rotate(D2R(formatAngle(angle)), rotat);
+    submitDraw(obj, meshProgram(obj, motion), translatemat * rotatemat, motion);
+}
+
+void drawtexture(VAO* obj,glm::vec3 trans,float angle,glm::vec3 rotat,const Motion& motion=still)
+{
+	glm::mat4 translateRectangle = glm::translate (trans);        // glTranslatef
+	glm::mat4 rotateRectangle = glm::rotate(D2R(formatAngle(angle)), rotat); // rotate about vector (-1,1,1)
+	submitDraw(obj, meshProgram(obj, motion), translateRectangle * rotateRectangle, motion);
+}
+
+/* Issue the frame's packets sorted by key, so each program and texture is bound once,
+   and every run of packets of one mesh goes out as a single instanced draw */
+void flushRenderQueue()
+{
+	vector<DrawPacket> &packets=render_queue.packets;
+	render_queue.submitted=packets.size();
+	render_queue.draws=0;
+	if (packets.empty())
+		return;
+	stable_sort(packets.begin(),packets.end(),packetBefore);
+	GLintptr base;
+	Instance* instances=(Instance*)mapRingRegion(render_queue.Instances, packets.size()*sizeof(Instance), base);
+	if (instances==NULL)
+	{
+		cout<<"Could not map the instance buffer, frame's draws skipped"<<endl;
+		packets.clear();
+		return;
+	}
+	for (size_t i = 0; i < packets.size(); i++)
+	{
+		instances[i].model=packets[i].model;
+		instances[i].motion=packets[i].motion;
+		instances[i].uv_rect=packets[i].mesh->AtlasRect;
+	}
+	if (!unmapRingRegion(render_queue.Instances))
+	{
+		cout<<"Instance buffer lost while mapped, frame's draws skipped"<<endl;
+		packets.clear();
+		return;
+	}
+	GLuint program=0;
+	for (size_t first = 0, last; first < packets.size(); first = last)
+	{
+		for (last = first+1; last < packets.size() && packets[last].key==packets[first].key; last++)
+			;
+		VAO* vao=packets[first].mesh;
+		if (packets[first].program!=program)
+		{
+			program=packets[first].program;
+			useProgram(program);
+		}
+		polygonMode (vao->FillMode);
+		bindVertexArray (vao->VertexArrayID);
+		enableVertexAttrib(vao, 0);
+		if (vao->TextureID)
+		{
+			bindTexture(vao->TextureID);
+			enableVertexAttrib(vao, 2);
+		}
+		else
+			enableVertexAttrib(vao, 1);
+		// Attributes 4-7 - per instance model matrix, 8 - its motion, 9 - its atlas region, starting at this run
+		glBindBuffer(GL_ARRAY_BUFFER, render_queue.Instances.Buffer);
+		for (int c = 0; c < 6; c++)
+		{
+			glVertexAttribPointer(4+c, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(base+first*sizeof(Instance)+c*sizeof(glm::vec4)));
+			glVertexAttribDivisor(4+c, 1);
+			enableVertexAttrib(vao, 4+c);
+		}
+		glDrawElementsInstanced(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_SHORT, (void*)0, last-first);
+		render_queue.draws++;
+	}
+	fenceRingRegion(render_queue.Instances);
+	packets.clear();
+}
+
+void reportRenderQueue()
+{
+	cout<<"Render queue: "<<render_queue.submitted<<" packets in "<<render_queue.draws<<" draws last frame, "<<render_queue.Instances.stalls<<" instance buffer stalls"<<endl;
+}
+
+/* One glyph of the font atlas - its UV rectangle, and in pixels its bitmap size,
+   the bitmap's offset from the pen and how far it advances the pen */
+struct Glyph {
+	float u0, v0, u1, v1;
+	int width, height, left, top, advance;
+};
+
+/* Printable ASCII rasterized once into a single channel atlas */
+struct GlyphFont {
+	TextureHandle Texture;
+	Glyph glyphs[128];
+	int line_height;
+} hud_font;
+
+/* A string laid out once - a quad per visible glyph, in pixels from the pen
+   on the baseline, y down */
+struct TextQuad {
+	float x0, y0, x1, y1;
+	float u0, v0, u1, v1;
+};
+struct TextLayout {
+	vector<TextQuad> quads;
+	float width;
+};
+
+struct TextVertex {
+	GLfloat position[2];
+	GLubyte color[4];
+	GLfloat uv[2];
+};
+
+/* Every piece of text of a frame is collected here and drawn in one call */
+struct TextBatch {
+	VertexArrayHandle VertexArrayID;
+	BufferHandle VertexBuffer;
+	GLint ScreenID;
+	vector<TextVertex> vertices;
+	map<string,TextLayout> layouts;
+} text_batch;
+const size_t max_text_layouts = 256;
+
+bool loadGlyphFont (const char* path, int pixel_size, GlyphFont& font)
+{
+	FT_Library library;
+	FT_Face face;
+	if (FT_Init_FreeType(&library))
+		return false;
+	if (FT_New_Face(library, path, 0, &face))
+	{
+		FT_Done_FreeType(library);
+		return false;
+	}
+	FT_Set_Pixel_Sizes(face, 0, pixel_size);
+
+	// Rasterize and shelf pack every glyph, then copy them all into the atlas
+	const int atlas_width = 256, gutter = 1;
+	vector<unsigned char> bitmaps[128];
+	int xs[128], ys[128], x = 0, y = 0, shelf = 0;
+	memset(font.glyphs, 0, sizeof(font.glyphs));
+	for (int c = 32; c < 127; c++)
+	{
+		if (FT_Load_Char(face, c, FT_LOAD_RENDER))
+			continue;
+		FT_GlyphSlot slot = face->glyph;
+		Glyph& glyph = font.glyphs[c];
+		glyph.width = slot->bitmap.width;
+		glyph.height = slot->bitmap.rows;
+		glyph.left = slot->bitmap_left;
+		glyph.top = slot->bitmap_top;
+		glyph.advance = slot->advance.x>>6;
+		for (int row = 0; row < glyph.height; row++)
+			bitmaps[c].insert(bitmaps[c].end(), slot->bitmap.buffer+row*slot->bitmap.pitch, slot->bitmap.buffer+row*slot->bitmap.pitch+glyph.width);
+		if (x+glyph.width>atlas_width)
+		{
+			y += shelf+gutter;
+			x = shelf = 0;
+		}
+		xs[c] = x;
+		ys[c] = y;
+		x += glyph.width+gutter;
+		shelf = max(shelf, glyph.height);
+	}
+	font.line_height = face->size->metrics.height>>6;
+	FT_Done_Face(face);
+	FT_Done_FreeType(library);
+
+	int atlas_height = 1;
+	while (atlas_height<y+shelf)
+		atlas_height *= 2;
+	vector<unsigned char> pixels(atlas_width*atlas_height, 0);
+	for (int c = 32; c < 127; c++)
+	{
+		Glyph& glyph = font.glyphs[c];
+		for (int row = 0; row < glyph.height; row++)
+			memcpy(&pixels[(ys[c]+row)*atlas_width+xs[c]], &bitmaps[c][row*glyph.width], glyph.width);
+		glyph.u0 = xs[c]/(float)atlas_width;
+		glyph.v0 = ys[c]/(float)atlas_height;
+		glyph.u1 = (xs[c]+glyph.width)/(float)atlas_width;
+		glyph.v1 = (ys[c]+glyph.height)/(float)atlas_height;
+	}
+	font.Texture = genTexture();
+	bindTexture(font.Texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, atlas_width, atlas_height, 0, GL_RED, GL_UNSIGNED_BYTE, &pixels[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	font.Texture.setBytes(atlas_width*atlas_height);
+	bindTexture(0);
+	cout << "Font: " << path << " at " << pixel_size << " px, glyphs in " << atlas_width << "x" << atlas_height << endl;
+	return true;
+}
+
+/* Layout of a string, computed the first time it is drawn. The cache is dropped
+   when it fills up, so changing values cannot grow it without bound */
+const TextLayout& layoutText (const string& text)
+{
+	map<string,TextLayout>::iterator cached = text_batch.layouts.find(text);
+	if (cached!=text_batch.layouts.end())
+		return cached->second;
+	if (text_batch.layouts.size()>=max_text_layouts)
+		text_batch.layouts.clear();
+	TextLayout& layout = text_batch.layouts[text];
+	float pen = 0;
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		int c = (unsigned char)text[i];
+		const Glyph& glyph = hud_font.glyphs[c>=32 && c<127 ? c : '?'];
+		if (glyph.width>0 && glyph.height>0)
+		{
+			TextQuad quad = {pen+glyph.left, (float)-glyph.top, pen+glyph.left+glyph.width, (float)glyph.height-glyph.top, glyph.u0, glyph.v0, glyph.u1, glyph.v1};
+			layout.quads.push_back(quad);
+		}
+		pen += glyph.advance;
+	}
+	layout.width = pen;
+	return layout;
+}
+
+/* Queue text with its baseline starting at x, y - pixels from the top left of the window */
+void drawtext(const string& text,float x,float y,glm::vec3 color,float scale=1)
+{
+	const TextLayout& layout = layoutText(text);
+	GLubyte rgba[4] = {(GLubyte)(255*color[0]), (GLubyte)(255*color[1]), (GLubyte)(255*color[2]), 255};
+	for (size_t i = 0; i < layout.quads.size(); i++)
+	{
+		const TextQuad& q = layout.quads[i];
+		TextVertex corners[4] = {
+			{{x+q.x0*scale, y+q.y0*scale}, {rgba[0], rgba[1], rgba[2], rgba[3]}, {q.u0, q.v0}},
+			{{x+q.x1*scale, y+q.y0*scale}, {rgba[0], rgba[1], rgba[2], rgba[3]}, {q.u1, q.v0}},
+			{{x+q.x1*scale, y+q.y1*scale}, {rgba[0], rgba[1], rgba[2], rgba[3]}, {q.u1, q.v1}},
+			{{x+q.x0*scale, y+q.y1*scale}, {rgba[0], rgba[1], rgba[2], rgba[3]}, {q.u0, q.v1}},
+		};
+		static const int triangles[6] = {0, 1, 2, 2, 3, 0};
+		for (int k = 0; k < 6; k++)
+			text_batch.vertices.push_back(corners[triangles[k]]);
+	}
+}
+
+void createTextBatch ()
+{
+	text_batch.VertexArrayID = genVertexArray();
+	text_batch.VertexBuffer = genBuffer();
+	bindVertexArray(text_batch.VertexArrayID);
+	glBindBuffer(GL_ARRAY_BUFFER, text_batch.VertexBuffer);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*)offsetof(TextVertex, position));
+	glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(TextVertex), (void*)offsetof(TextVertex, color));
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(TextVertex), (void*)offsetof(TextVertex, uv));
+	for (int i = 0; i < 3; i++)
+		glEnableVertexAttribArray(i);
+	text_batch.ScreenID = glGetUniformLocation(fontProgramID, "screen");
+	useProgram(fontProgramID);
+	glUniform1i(glGetUniformLocation(fontProgramID, "glyphSampler"), 0); // Sampler unit never changes
+}
+
+/* Pixels from the top left of the viewport to clip space, for screen space overlays */
+glm::mat4 screenMatrix ()
+{
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	return glm::ortho(0.0f, (float)viewport[2], (float)viewport[3], 0.0f);
+}
+
+/* Draw the frame's text in one orthographic, blended pass over everything else */
+void flushText ()
+{
+	if (text_batch.vertices.empty())
+		return;
+	glm::mat4 screen = screenMatrix();
+	useProgram(fontProgramID);
+	glUniformMatrix4fv(text_batch.ScreenID, 1, GL_FALSE, &screen[0][0]);
+	bindVertexArray(text_batch.VertexArrayID);
+	bufferData(text_batch.VertexBuffer, GL_ARRAY_BUFFER, text_batch.vertices.size()*sizeof(TextVertex), &text_batch.vertices[0], GL_STREAM_DRAW);
+	bindTexture(hud_font.Texture);
+	polygonMode(GL_FILL);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDrawArrays(GL_TRIANGLES, 0, text_batch.vertices.size());
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+	text_batch.vertices.clear();
+}
+
+/* Seven segment counters - every lit segment of every counter is an instance of
+   one unit quad, so the whole display is a single draw. Segments are numbered as
+   in a[10][7] : top, top right, bottom right, bottom, bottom left, top left, middle */
+enum { COUNTER_SCORE, COUNTER_HEALTH, COUNTER_FPS, COUNTER_FRAME_MS, HUD_COUNTERS };
+
+struct Counter {
+	const char* label;
+	glm::vec3 color;
+	int value; // shown value, -1 before the first
+};
+
+struct SegmentInstance {
+	GLfloat rect[4]; // x, y, width, height in pixels
+	GLubyte color[4];
+};
+
+struct SegmentHUD {
+	VertexArrayHandle VertexArrayID;
+	BufferHandle QuadBuffer;
+	BufferHandle InstanceBuffer;
+	GLint ScreenID;
+	Counter counters[HUD_COUNTERS];
+	bool dirty;
+	int instances, rebuilds;
+	double sample_start; // FPS and frame time are averaged over half a second
+	int sample_frames;
+} segment_hud = {
+	VertexArrayHandle(), BufferHandle(), BufferHandle(), -1,
+	{{"SCORE", glm::vec3(1,0.85,0.2), 0}, {"HEALTH", glm::vec3(1,0.3,0.3), 0}, {"FPS", glm::vec3(0.6,1,0.6), 0}, {"MS", glm::vec3(0.6,0.8,1), 0}},
+	true, 0, 0, 0, 0
+};
+const float segment_length = 14, segment_width = 3, segment_gap = 6; // pixels
+const float hud_left = 16, hud_top = 16, hud_row = 48, hud_digits_left = 120;
+
+void setCounter (int counter, int value)
+{
+	value = max(value, 0);
+	if (segment_hud.counters[counter].value==value)
+		return;
+	segment_hud.counters[counter].value = value;
+	segment_hud.dirty = true;
+}
+
+/* Segments of one digit with its top left corner at x, y */
+void addDigitSegments (vector<SegmentInstance>& instances, int digit, float x, float y, const glm::vec3& color)
+{
+	const float L = segment_length, T = segment_width;
+	const float rects[7][4] = {
+		{x+T, y, L, T}, {x+T+L, y+T, T, L}, {x+T+L, y+2*T+L, T, L}, {x+T, y+2*T+2*L, L, T},
+		{x, y+2*T+L, T, L}, {x, y+T, T, L}, {x+T, y+T+L, L, T},
+	};
+	for (int segment = 0; segment < 7; segment++)
+	{
+		if (a[digit][segment]!=1)
+			continue;
+		SegmentInstance instance = {{rects[segment][0], rects[segment][1], rects[segment][2], rects[segment][3]},
+			{(GLubyte)(255*color[0]), (GLubyte)(255*color[1]), (GLubyte)(255*color[2]), 255}};
+		instances.push_back(instance);
+	}
+}
+
+/* Lay every counter out again - only when a shown value has changed */
+void rebuildSegments ()
+{
+	vector<SegmentInstance> instances;
+	for (int i = 0; i < HUD_COUNTERS; i++)
+	{
+		const Counter& counter = segment_hud.counters[i];
+		char digits[16];
+		sprintf(digits, "%d", counter.value);
+		for (int d = 0; digits[d]; d++)
+			if (digits[d]>='0' && digits[d]<='9') // a[][] only has the ten digits
+				addDigitSegments(instances, digits[d]-'0', hud_digits_left + d*(segment_length+2*segment_width+segment_gap), hud_top + i*hud_row, counter.color);
+	}
+	bufferData(segment_hud.InstanceBuffer, GL_ARRAY_BUFFER, instances.size()*sizeof(SegmentInstance), instances.empty() ? NULL : &instances[0], GL_DYNAMIC_DRAW);
+	segment_hud.instances = instances.size();
+	segment_hud.dirty = false;
+	segment_hud.rebuilds++;
+}
+
+void createSegmentHUD ()
+{
+	intialize_a();
+	static const GLfloat quad[8] = {0,0, 1,0, 0,1, 1,1};
+	segment_hud.VertexArrayID = genVertexArray();
+	bindVertexArray(segment_hud.VertexArrayID);
+	segment_hud.QuadBuffer = genBuffer();
+	bufferData(segment_hud.QuadBuffer, GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+	glEnableVertexAttribArray(0);
+	// Attributes 4 - segment rectangle, 5 - its colour, one per instance
+	segment_hud.InstanceBuffer = genBuffer();
+	glBindBuffer(GL_ARRAY_BUFFER, segment_hud.InstanceBuffer);
+	glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(SegmentInstance), (void*)offsetof(SegmentInstance, rect));
+	glVertexAttribPointer(5, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(SegmentInstance), (void*)offsetof(SegmentInstance, color));
+	for (int i = 4; i <= 5; i++)
+	{
+		glVertexAttribDivisor(i, 1);
+		glEnableVertexAttribArray(i);
+	}
+	segment_hud.ScreenID = glGetUniformLocation(segmentProgramID, "screen");
+	segment_hud.sample_start = glfwGetTime();
+}
+
+void drawSegments ()
+{
+	if (segment_hud.dirty)
+		rebuildSegments();
+	if (segment_hud.instances==0)
+		return;
+	glm::mat4 screen = screenMatrix();
+	useProgram(segmentProgramID);
+	glUniformMatrix4fv(segment_hud.ScreenID, 1, GL_FALSE, &screen[0][0]);
+	bindVertexArray(segment_hud.VertexArrayID);
+	polygonMode(GL_FILL);
+	glDisable(GL_DEPTH_TEST);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, segment_hud.instances);
+	glEnable(GL_DEPTH_TEST);
+}
+
+/* Screen space overlay, drawn last - counter labels as text, values as segments */
+void drawHUD ()
+{
+	segment_hud.sample_frames++;
+	double elapsed = glfwGetTime()-segment_hud.sample_start;
+	if (elapsed>=0.5)
+	{
+		setCounter(COUNTER_FPS, (int)(segment_hud.sample_frames/elapsed+0.5));
+		setCounter(COUNTER_FRAME_MS, (int)(1000*elapsed/segment_hud.sample_frames+0.5));
+		segment_hud.sample_start += elapsed;
+		segment_hud.sample_frames = 0;
+	}
+	setCounter(COUNTER_SCORE, (int)score);
+	setCounter(COUNTER_HEALTH, (int)ceil(person_health));
+	drawSegments();
+	for (int i = 0; i < HUD_COUNTERS; i++)
+		drawtext(segment_hud.counters[i].label, hud_left, hud_top + i*hud_row + 2*segment_length, glm::vec3(1,1,1));
+	flushText();
+}
+
+void reportSegmentHUD ()
+{
+	cout<<"HUD: "<<segment_hud.instances<<" segments in 1 draw, rebuilt "<<segment_hud.rebuilds<<" times"<<endl;
+}
+
+/* Materials of the pool/pit voxels drawn over the terrain, one mesh each */
+enum { MATERIAL_WATER, MATERIAL_FIRE, TERRAIN_MATERIALS };
+
+/* Quadrants of the heights grid, unlocked one by one as keys are collected */
+struct TerrainQuadrant {
+	int start1,end1,start2,end2; // heights[start1..end1)[start2..end2)
+	int key; // keys needed before the quadrant is drawn
+	int overlay; // material drawn over the pools/pits of the quadrant
+	double overlay_height; // heights[][] value that gets the overlay
+	int stacked; // overlay fills the pit from the bottom instead of a single slab
+};
+
+/* Shared rows/columns of the old overlapping loops belong to the quadrant unlocked first */
+TerrainQuadrant terrain_quadrants[4] = {
+	{14,30,14,30, 0, MATERIAL_WATER, 4, 0},
+	{ 0,14,14,30, 1, MATERIAL_WATER, 4, 0},
+	{ 0,15, 0,14, 2, MATERIAL_FIRE,  0, 1},
+	{15,30, 0,14, 3, MATERIAL_WATER, 0, 1}
+};
+
+struct TerrainInstances {
+	BufferHandle InstanceBuffer;
+	vector<glm::vec4> Offsets; // xyz - voxel centre, w - material
+	int First[TERRAIN_MATERIALS];
+	int Count[TERRAIN_MATERIALS];
+	double Heights[30][30]; // heights[][] the buffer was built from
+	double Key;
+	int Valid;
+} Terrain;
+
+void addTerrainInstance(vector<glm::vec4> *lists,int material,int i2,int i,double y)
+{
+	lists[material].push_back(glm::vec4(
+		length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base,
+		y,
+		length_of_cube_base/2.0+((i-width_of_base/2.0)*length_of_cube_base),
+		material));
+}
+
+/* Rebuild the overlay instance buffer, only when the grid or the unlocked quadrants changed */
+void updateTerrainInstances()
+{
+	if (Terrain.Valid && Terrain.Key==key && memcmp(Terrain.Heights,heights,sizeof(heights))==0)
+		return;
+	vector<glm::vec4> lists[TERRAIN_MATERIALS];
+	for (int q = 0; q < 4; q++)
+	{
+		TerrainQuadrant &t=terrain_quadrants[q];
+		if (key<t.key)
+			continue;
+		for (int i2 = t.start1; i2 < t.end1; i2++)
+			for (int i = t.start2; i < t.end2; i++)
+			{
+				if (heights[i2][i]!=t.overlay_height)
+					continue;
+				if (t.stacked)
+					for (int i1 = 0; i1 < height_of_base-1; i1++)
+						addTerrainInstance(lists,t.overlay,i2,i,length_of_cube_base/2.0+(i1-1)*length_of_cube_base);
+				else
+					addTerrainInstance(lists,t.overlay,i2,i,length_of_cube_base/2.0+(height_of_base-3)*length_of_cube_base);
+			}
+	}
+	Terrain.Offsets.clear();
+	for (int m = 0; m < TERRAIN_MATERIALS; m++)
+	{
+		Terrain.First[m]=Terrain.Offsets.size();
+		Terrain.Count[m]=lists[m].size();
+		Terrain.Offsets.insert(Terrain.Offsets.end(),lists[m].begin(),lists[m].end());
+	}
+	if (Terrain.InstanceBuffer==0)
+		Terrain.InstanceBuffer=genBuffer();
+	bufferData(Terrain.InstanceBuffer, GL_ARRAY_BUFFER, Terrain.Offsets.size()*sizeof(glm::vec4), Terrain.Offsets.empty() ? NULL : &Terrain.Offsets[0], GL_STATIC_DRAW);
+	memcpy(Terrain.Heights,heights,sizeof(heights));
+	Terrain.Key=key;
+	Terrain.Valid=1;
+}
+
+/* Solid voxels of one quadrant, merged into a single mesh */
+struct TerrainChunk {
+	VAO* Mesh;
+	double Heights[16][16]; // heights[][] of the quadrant the mesh was built from
+	int Valid;
+} terrain_chunks[4];
+
+/* Face colors of the terrain cube - front, back, left, right, top, bottom as in createCube */
+GLfloat terrain_face_colors[6][3];
+
+int terrainSolid(TerrainQuadrant &t,int x,int y,int z)
+{
+	if (x<0||y<0||z<0||x>=t.end1-t.start1||z>=t.end2-t.start2)
+		return 0;
+	return y<heights[t.start1+x][t.start2+z];
+}
+
+void addTerrainQuad(vector<GLfloat> &vertices,vector<GLfloat> &colors,glm::vec3 p,glm::vec3 du,glm::vec3 dv,GLfloat clr[3])
+{
+	glm::vec3 corners[6] = {p, p+du, p+du+dv, p+du+dv, p+dv, p};
+	for (int i = 0; i < 6; i++)
+		for (int k = 0; k < 3; k++)
+		{
+			vertices.push_back(corners[i][k]);
+			colors.push_back(clr[k]);
+		}
+}
+
+/* Greedy mesh of the quadrant: only faces between a solid and an empty cell are kept,
+   and coplanar neighbouring faces are merged into the largest rectangles possible.
+   Cells outside the quadrant count as empty so every quadrant can be rebuilt on its own.
+   report prints the triangle counts - set for the first build of a quadrant only */
+VAO* buildTerrainChunk(TerrainQuadrant &t, int report)
+{
+	int dims[3] = {t.end1-t.start1, 0, t.end2-t.start2};
+	for (int i2 = t.start1; i2 < t.end1; i2++)
+		for (int i = t.start2; i < t.end2; i++)
+			dims[1]=max(dims[1],(int)ceil(heights[i2][i]));
+	// face index in terrain_face_colors for +/- direction along x, y and z
+	static const int faces[3][2] = {{3,2},{4,5},{0,1}};
+	vector<GLfloat> vertices,colors;
+	int voxels=0;
+	for (int d = 0; d < 3; d++)
+	{
+		int u=(d+1)%3,v=(d+2)%3;
+		int x[3]={0,0,0},q[3]={0,0,0};
+		q[d]=1;
+		vector<int> mask(dims[u]*dims[v]);
+		for (x[d] = -1; x[d] < dims[d];)
+		{
+			// 1 - face towards +d, -1 - face towards -d, 0 - hidden
+			int n=0;
+			for (x[v] = 0; x[v] < dims[v]; x[v]++)
+				for (x[u] = 0; x[u] < dims[u]; x[u]++)
+				{
+					int a=terrainSolid(t,x[0],x[1],x[2]);
+					int b=terrainSolid(t,x[0]+q[0],x[1]+q[1],x[2]+q[2]);
+					if (d==0 && a)
+						voxels++;
+					mask[n++] = a==b ? 0 : (a ? 1 : -1);
+				}
+			x[d]++;
+			n=0;
+			for (int j = 0; j < dims[v]; j++)
+				for (int i = 0; i < dims[u];)
+				{
+					int c=mask[n];
+					if (c==0)
+					{
+						i++;
+						n++;
+						continue;
+					}
+					int w=1,h=1;
+					while (i+w<dims[u] && mask[n+w]==c)
+						w++;
+					for (; j+h<dims[v]; h++)
+					{
+						int k=0;
+						while (k<w && mask[n+k+h*dims[u]]==c)
+							k++;
+						if (k<w)
+							break;
+					}
+					int p[3];
+					p[d]=x[d];
+					p[u]=i;
+					p[v]=j;
+					glm::vec3 origin(
+						(t.start1+p[0]-length_of_base/2.0)*length_of_cube_base,
+						(p[1]-1)*length_of_cube_base,
+						(t.start2+p[2]-width_of_base/2.0)*length_of_cube_base);
+					glm::vec3 du(0),dv(0);
+					du[u]=w*length_of_cube_base;
+					dv[v]=h*length_of_cube_base;
+					addTerrainQuad(vertices,colors,origin,du,dv,terrain_face_colors[faces[d][c==1 ? 0 : 1]]);
+					for (int l = 0; l < h; l++)
+						for (int k = 0; k < w; k++)
+							mask[n+k+l*dims[u]]=0;
+					i+=w;
+					n+=w;
+				}
+		}
+	}
+	if (report)
+		cout << "Terrain quadrant " << t.start1 << "," << t.start2 << ": " << vertices.size()/9 << " triangles (" << voxels*12 << " before meshing)" << endl;
+	return create3DObject(GL_TRIANGLES, vertices.size()/3, vertices.empty() ? NULL : &vertices[0], colors.empty() ? NULL : &colors[0], GL_FILL);
+}
+
+/* Rebuild the mesh of a quadrant only when its part of heights[][] changed */
+void updateTerrainChunk(int q)
+{
+	TerrainQuadrant &t=terrain_quadrants[q];
+	TerrainChunk &chunk=terrain_chunks[q];
+	int changed=!chunk.Valid;
+	for (int i2 = t.start1; i2 < t.end1; i2++)
+		for (int i = t.start2; i < t.end2; i++)
+			if (chunk.Heights[i2-t.start1][i-t.start2]!=heights[i2][i])
+			{
+				chunk.Heights[i2-t.start1][i-t.start2]=heights[i2][i];
+				changed=1;
+			}
+	if (!changed)
+		return;
+	if (chunk.Mesh)
+		delete3DObject(chunk.Mesh);
+	chunk.Mesh=buildTerrainChunk(t,!chunk.Valid);
+	chunk.Valid=1;
+	resettleGLResources();
+}
+
+/* Draw the unlocked quadrants - one mesh per quadrant, one instanced draw per overlay material */
+void drawTerrain()
+{
+	for (int q = 0; q < 4; q++)
+	{
+		if (key<terrain_quadrants[q].key)
+			continue;
+		updateTerrainChunk(q);
+		drawobject(terrain_chunks[q].Mesh,glm::vec3(0,0,0),0,glm::vec3(0,0,1));
+	}
+	VAO* meshes[TERRAIN_MATERIALS] = {water, fire};
+	updateTerrainInstances();
+	useProgram(terrainProgramID);
+	for (int m = 0; m < TERRAIN_MATERIALS; m++)
+	{
+		if (Terrain.Count[m]==0)
+			continue;
+		VAO* vao=meshes[m];
+		polygonMode (vao->FillMode);
+		bindVertexArray (vao->VertexArrayID);
+		enableVertexAttrib(vao, 0);
+		enableVertexAttrib(vao, 1);
+		glUniform1f(Matrices.TerrainScaleID, vao->PositionScale);
+		// Attribute 3 - per instance offset, starting at this material's range
+		glBindBuffer(GL_ARRAY_BUFFER, Terrain.InstanceBuffer);
+		glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 0, (void*)(Terrain.First[m]*sizeof(glm::vec4)));
+		glVertexAttribDivisor(3, 1);
+		enableVertexAttrib(vao, 3);
+		glDrawElementsInstanced(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_SHORT, (void*)0, Terrain.Count[m]);
+	}
+}
+
+/* Joints of the player rig - every part hangs off the root bone */
+enum { BONE_ROOT, BONE_LEG_LEFT, BONE_LEG_RIGHT, BONE_HAND_LEFT, BONE_HAND_RIGHT, PERSON_BONES };
+
+struct Bone {
+	int parent; // parents come before their children
+	glm::vec3 joint; // pivot in the parent's space, figure facing -x
+	glm::vec3 axis; // swing axis
+	float swing; // gain on the walk cycle angle
+};
+
+Bone person_rig[PERSON_BONES] = {
+	{-1,        glm::vec3(0,0,0),   glm::vec3(0,0,1), 0},
+	{BONE_ROOT, glm::vec3(0,10,6),  glm::vec3(0,0,1), 1},
+	{BONE_ROOT, glm::vec3(0,10,-6), glm::vec3(0,0,1), -1},
+	{BONE_ROOT, glm::vec3(0,30,-18),glm::vec3(0,0,1), 1},
+	{BONE_ROOT, glm::vec3(0,30,12), glm::vec3(0,0,1), -1}
+};
+
+/* Append one part of the player mesh, placed in the space of its bone */
+void addPersonPart(vector<GLfloat> &vertices,vector<GLfloat> &colors,vector<GLfloat> &bones,const GLfloat *part,int numVertices,glm::mat4 placement,GLfloat gray,int bone)
+{
+	for (int i = 0; i < numVertices; i++)
+	{
+		glm::vec4 v = placement * glm::vec4(part[3*i],part[3*i+1],part[3*i+2],1);
+		for (int k = 0; k < 3; k++)
+		{
+			vertices.push_back(v[k]);
+			colors.push_back(gray);
+		}
+		bones.push_back(bone);
+	}
+}
+
+/* The whole player as one skinned mesh, modelled facing -x with its feet at the origin */
+VAO* createPerson()
+{
+	vector<GLfloat> vertices,colors,bones;
+	GLfloat part[108];
+	vector<GLfloat> round;
+	double L=length_of_cube_base;
+	cube1Vertices(part,4,4,-12);
+	addPersonPart(vertices,colors,bones,part,36,glm::mat4(1.0f),0,BONE_LEG_LEFT);
+	addPersonPart(vertices,colors,bones,part,36,glm::mat4(1.0f),0,BONE_LEG_RIGHT);
+	cube1Vertices(part,3,3,-10);
+	addPersonPart(vertices,colors,bones,part,36,glm::mat4(1.0f),1,BONE_HAND_LEFT);
+	addPersonPart(vertices,colors,bones,part,36,glm::mat4(1.0f),1,BONE_HAND_RIGHT);
+	cubeVertices(part,L/2,L/2,L/2);
+	addPersonPart(vertices,colors,bones,part,36,glm::translate(glm::vec3(0,12+L/3,0)),0,BONE_ROOT);
+	cubeVertices(part,10,18,6);
+	addPersonPart(vertices,colors,bones,part,36,glm::translate(glm::vec3(0,12+7+L,0)),0.5,BONE_ROOT);
+	cubeVertices(part,11,22,4);
+	addPersonPart(vertices,colors,bones,part,36,glm::translate(glm::vec3(2,12+7+6+L,0)),0.7,BONE_ROOT);
+	latheVertices(cylinderProfile(sqrt(3*3+3*3),7),2,round);
+	addPersonPart(vertices,colors,bones,&round[0],round.size()/3,glm::translate(glm::vec3(0,12+L,0)),0,BONE_ROOT);
+	round.clear();
+	latheVertices(cylinderProfile(sqrt(2*2+2*2),2),1,round);
+	for (int side = -1; side <= 1; side+=2)
+		addPersonPart(vertices,colors,bones,&round[0],round.size()/3,glm::translate(glm::vec3(-10,12+6+L,8*side))*glm::rotate(D2R(90),glm::vec3(0,0,1)),0,BONE_ROOT);
+	return createSkinnedObject(GL_TRIANGLES, vertices.size()/3, &vertices[0], &colors[0], &bones[0], GL_FILL);
+}
+
+/* Facing of the player in degrees about y, 0 is -x */
+float personYaw()
+{
+	if (camera_x_direction==1)
+		return 0;
+	if (camera_x_direction==-1)
+		return 180;
+	if (camera_z_direction==1)
+		return -90;
+	return 90;
+}
+
+/* Walk cycle: pose the rig from the swing angle and compose the bone matrices down the hierarchy */
+void posePerson(glm::mat4 root,float walk_angle,glm::mat4 pose[PERSON_BONES])
+{
+	for (int i = 0; i < PERSON_BONES; i++)
+	{
+		Bone &b=person_rig[i];
+		glm::mat4 local = glm::translate(b.joint) * glm::rotate(D2R(formatAngle(b.swing*walk_angle)), b.axis);
+		pose[i] = (b.parent<0 ? root : pose[b.parent]) * local;
+	}
+}
+
+/* Draw the posed player with a single draw call */
+void drawPerson()
+{
+	glm::mat4 pose[PERSON_BONES];
+	glm::mat4 root = glm::translate(glm::vec3(person_x,person_y+jump_speed,person_z)) * glm::rotate(D2R(formatAngle(personYaw())), glm::vec3(0,1,0));
+	posePerson(root,person_hand_angle,pose);
+	for (int i = 0; i < PERSON_BONES; i++)
+		pose[i] = pose[i] * glm::scale(glm::vec3(person->PositionScale));
+	useProgram(skinnedProgramID);
+	glUniformMatrix4fv(Matrices.BonesID, PERSON_BONES, GL_FALSE, &pose[0][0][0]);
+	draw3DObject(person);
+}
+
+/* Health bar geometry as last streamed, so it is only rebuilt when it changes */
+double health_bar_value=-1;
+int health_bar_axis=-1;
+
+/* Resize the health bar along the facing axis whenever the health or the facing changes */
+void updateHealthBar()
+{
+	int axis=health_bar_axis;
+	if (camera_x_direction==1||camera_x_direction==-1)
+		axis=0;
+	if (camera_z_direction==1||camera_z_direction==-1)
+		axis=2;
+	if (axis==health_bar_axis && person_health==health_bar_value)
+		return;
+	health_bar_axis=axis;
+	health_bar_value=person_health;
+	GLfloat vertex_buffer_data[108],clr[108];
+	for (int i = 0; i <36;i++)
+	{
+		clr[3*i]=1;
+		clr[3*i+2]=0;
+		clr[3*i+1]=0;
+	}
+	if (axis==0)
+		cubeVertices(vertex_buffer_data,2,person_health/2,2);
+	else
+		cubeVertices(vertex_buffer_data,person_health/2,2,2);
+	updateDynamicObject(health,36,vertex_buffer_data,clr);
+}
+
+/* Report GL objects beyond what the game settled at - the counts should stay flat while playing */
+void checkGLObjectLeaks()
+{
+	int* settled=gl_leak_baseline.count;
+	if (!gl_leak_baseline.settled)
+	{
+		memcpy(settled,gl_resources.count,sizeof(gl_leak_baseline.count));
+		gl_leak_baseline.settled=true;
+		reportGLResources();
+		return;
 	}
-	if (adventure_view==1)
+	int leaked=0;
+	for (int k = 0; k < GL_RESOURCE_KINDS; k++)
+		if (gl_resources.count[k]>settled[k])
+		{
+			leaked=1;
+			settled[k]=gl_resources.count[k];
+		}
+	if (leaked)
 	{
-		x=person_x-50*camera_x_direction*-1;//*camera_x_direction;
-		y=person_y+100;
-		z=person_z-50*camera_z_direction*-1;
-		x1=person_x;
-		y1=person_y;
-		z1=person_z;	
+		cout<<"GL object leak - ";
+		reportGLResources();
 	}
-    Matrices.view = glm::lookAt(glm::vec3(x,y,z), glm::vec3(x1,y1,z1), glm::vec3(0,1,0));
-    glm::mat4 VP = Matrices.projection * Matrices.view;
-    glm::mat4 MVP;  // MVP = Projection * View * Model
-    Matrices.model = glm::mat4(1.0f);
-    glm::mat4 translatemat = glm::translate(trans);
-    glm::mat4 rotatemat = glm::rotate(D2R(formatAngle(angle)), rotat);
-    Matrices.model *= (translatemat * rotatemat);
-    MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-    draw3DObject(obj);
-}
-
-void drawtexture(VAO* obj,glm::vec3 trans,float angle,glm::vec3 rotat)
-{
-	// glUseProgram(textureProgramID);
-	// Matrices.view = glm::lookAt(glm::vec3(0,0,0), glm::vec3(0,0,0), glm::vec3(0,1,0));
-    glm::mat4 VP = Matrices.projection * Matrices.view;
-    glm::mat4 MVP;  // MVP = Projection * View * Model
- //    Matrices.model = glm::mat4(1.0f);
- //    glm::mat4 translatemat = glm::translate(trans);
- //    glm::mat4 rotatemat = glm::rotate(D2R(formatAngle(angle)), rotat);
- //    Matrices.model *= (translatemat * rotatemat);
- //    MVP = VP * Matrices.model;
- //    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
- //    glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
- //    draw3DObject(obj);
-	glUseProgram(textureProgramID);
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 translateRectangle = glm::translate (trans);        // glTranslatef
-	glm::mat4 rotateRectangle = glm::rotate(D2R(formatAngle(angle)), rotat); // rotate about vector (-1,1,1)
-	Matrices.model *= (translateRectangle * rotateRectangle);
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.TexMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-	draw3DTexturedObject(obj);
-}
-
-void drawtext(char *s,glm::vec3 trans)
-{
-	glUseProgram(fontProgramID);
-	static int fontScale = 1;
-	float fontScaleValue = 0.75 + 0.25*sinf(fontScale*M_PI/180.0f);
-	fontScale = (fontScale + 1) % 360;
-	glm::vec3 fontColor = getRGBfromHue (fontScale);
-	Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-	glm::mat4 MVP;
-	Matrices.model = glm::mat4(1.0f);
-	double x=0;
-	glm::mat4 translateText = glm::translate(glm::vec3(width/2,10,height/2));
-	glm::mat4 scaleText = glm::scale(glm::vec3(0.5,0.5,0.5));
-	Matrices.model *= (translateText * scaleText);
-	MVP = Matrices.projection * Matrices.view * Matrices.model;
-	glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-	glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-	GL3Font.font->Render(s);
-}
-
-void draw ()
+}
+
+/* Fixed simulation rate - render() interpolates between the two latest ticks */
+const double tick_seconds = 1/60.0;
+const double max_frame_seconds = 0.25; // longer stalls are dropped rather than caught up
+double sim_time = 0;
+int swap_interval = 1; // 0 with --uncapped
+int show_stats = 0; // renderer statistics every 0.5s, with --stats
+
+/* The part of the game state that moves smoothly between ticks */
+struct RenderState {
+	double person_x, person_y, person_z, jump_speed;
+	double wall_x[5];
+};
+RenderState previous_tick_state;
+
+RenderState captureRenderState ()
+{
+	RenderState state = {person_x, person_y, person_z, jump_speed, {0}};
+	for (int i = 0; i < 5; i++)
+		state.wall_x[i] = wall[i][0];
+	return state;
+}
+
+void applyRenderState (const RenderState& state)
+{
+	person_x = state.person_x;
+	person_y = state.person_y;
+	person_z = state.person_z;
+	jump_speed = state.jump_speed;
+	for (int i = 0; i < 5; i++)
+		wall[i][0] = state.wall_x[i];
+}
+
+/* Blend two ticks - a jump too big for one tick (a respawn) is not smoothed */
+RenderState interpolateRenderState (const RenderState& from, const RenderState& to, double alpha)
+{
+	if (fabs(to.person_x-from.person_x)+fabs(to.person_y-from.person_y)+fabs(to.person_z-from.person_z) > 100)
+		return to;
+	RenderState state;
+	state.person_x = from.person_x + (to.person_x-from.person_x)*alpha;
+	state.person_y = from.person_y + (to.person_y-from.person_y)*alpha;
+	state.person_z = from.person_z + (to.person_z-from.person_z)*alpha;
+	state.jump_speed = from.jump_speed + (to.jump_speed-from.jump_speed)*alpha;
+	for (int i = 0; i < 5; i++)
+		state.wall_x[i] = from.wall_x[i] + (to.wall_x[i]-from.wall_x[i])*alpha;
+	return state;
+}
+
+/* Advance the game by one tick of dt seconds - input, movement, collisions and
+   pickups, with no drawing. Per tick speeds were tuned for 60 ticks a second */
+void update (double dt)
 {
 	// if (person_jump==0)
 	// 	person_y-=1;
@@ -1537,12 +3601,6 @@ void draw ()
 			jump_direction=1;
 		}
 	}
-	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glUseProgram (programID);
-	glUseProgram(textureProgramID);
-	glUseProgram(fontProgramID);
-	//drawtext("hello");
-	//for (int i = 0; i < 10; ++i)
 	if(key>=1)
 	{
 		int x=length_of_base;
@@ -1561,8 +3619,9 @@ void draw ()
 		heights[(x-2)/2][13]=height_of_base;
 		heights[(x-2)/2][14]=height_of_base;
 	}
-	glUseProgram (programID);
-
+	sim_time += dt;
+	anim_time = sim_time;
+	// Terrain collision - the quadrants the player can walk on
 	if (key>=0)
 	{
 		start1=14;
@@ -1572,16 +3631,6 @@ void draw ()
 		for (int i2 = start1; i2 <end1;i2++)
 			for (int i = start2; i <end2;i++)
 			{
-				for (int i1 = 0; i1<heights[i2][i];i1++)
-					drawobject(cube,glm::vec3(
-						length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base,
-						length_of_cube_base/2.0+(i1-1)*length_of_cube_base,
-						length_of_cube_base/2.0+((i-width_of_base/2.0)*length_of_cube_base)),0,glm::vec3(0,0,1));
-				if (heights[i2][i]==4)
-					drawobject(water,glm::vec3(
-							length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base,
-							length_of_cube_base/2.0+(height_of_base-3)*length_of_cube_base,
-							length_of_cube_base/2.0+((i-width_of_base/2.0)*length_of_cube_base)),0,glm::vec3(0,0,1));
 				var1=person_x-(length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base);
 				if (var1<0)
 					var1*=-1;
@@ -1589,10 +3638,6 @@ void draw ()
 				if (var3<0)
 					var3*=-1;
 				var2=person_y-(length_of_cube_base/2.0+(heights[i2][i]-1)*length_of_cube_base);
-				if (var1<length_of_cube_base/2&&var3<length_of_cube_base/2)
-				{
-					cout<<person_y+jump_speed<<"	"<<var2<<endl;
-				}
 					
 				// {
 				// 	if (person_y+jump_speed<(length_of_cube_base/2.0+(heights[i2][i]-1)*length_of_cube_base)+length_of_cube_base/2)
@@ -1611,7 +3656,6 @@ void draw ()
 						person_y=prev_y;
 						person_x=prev_x;
 						person_z=prev_z;
-						cout<<"inif"<<endl;
 					}
 					else
 					{
@@ -1632,17 +3676,6 @@ void draw ()
 		for (int i2 = start1; i2 <end1;i2++)
 			for (int i = start2; i <end2;i++)
 			{
-				for (int i1 = 0; i1<heights[i2][i];i1++)
-					drawobject(cube,glm::vec3(
-						length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base,
-						length_of_cube_base/2.0+(i1-1)*length_of_cube_base,
-						length_of_cube_base/2.0+((i-width_of_base/2.0)*length_of_cube_base)),0,glm::vec3(0,0,1));
-				if (heights[i2][i]==4)
-					for (int i1 = 0; i1 < height_of_base-1;i1++)
-						drawobject(water,glm::vec3(
-							length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base,
-							length_of_cube_base/2.0+(height_of_base-3)*length_of_cube_base,
-							length_of_cube_base/2.0+((i-width_of_base/2.0)*length_of_cube_base)),0,glm::vec3(0,0,1));
 				var1=person_x-(length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base);
 				if (var1<0)
 					var1*=-1;
@@ -1650,10 +3683,6 @@ void draw ()
 				if (var3<0)
 					var3*=-1;
 				var2=person_y-(length_of_cube_base/2.0+(heights[i2][i]-1)*length_of_cube_base);
-				if (var1<length_of_cube_base/2&&var3<length_of_cube_base/2)
-				{
-					cout<<person_y+jump_speed<<"	"<<var2<<endl;
-				}
 					
 				// {
 				// 	if (person_y+jump_speed<(length_of_cube_base/2.0+(heights[i2][i]-1)*length_of_cube_base)+length_of_cube_base/2)
@@ -1672,7 +3701,6 @@ void draw ()
 						person_y=prev_y;
 						person_x=prev_x;
 						person_z=prev_z;
-						cout<<"inif"<<endl;
 					}
 					else
 					{
@@ -1684,50 +3712,6 @@ void draw ()
 				}
 			}
 	}
-	if (key>=2)
-	{
-		start1=0;
-		start2=0;
-		end1=15;
-		end2=15;
-		for (int i2 = start1; i2 <end1;i2++)
-			for (int i = start2; i <end2;i++)
-			{
-				for (int i1 = 0; i1<heights[i2][i];i1++)
-					drawobject(cube,glm::vec3(
-						length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base,
-						length_of_cube_base/2.0+(i1-1)*length_of_cube_base,
-						length_of_cube_base/2.0+((i-width_of_base/2.0)*length_of_cube_base)),0,glm::vec3(0,0,1));
-				if (heights[i2][i]==0)
-					for (int i1 = 0; i1 < height_of_base-1;i1++)
-						drawobject(fire,glm::vec3(
-							length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base,
-							length_of_cube_base/2.0+(i1-1)*length_of_cube_base,
-							length_of_cube_base/2.0+((i-width_of_base/2.0)*length_of_cube_base)),0,glm::vec3(0,0,1));
-			}
-	}
-	if(key>=3)
-	{
-		start1=14;
-		start2=0;
-		end1=30;
-		end2=15;
-		for (int i2 = start1; i2 <end1;i2++)
-			for (int i = start2; i <end2;i++)
-			{
-				for (int i1 = 0; i1<heights[i2][i];i1++)
-					drawobject(cube,glm::vec3(
-						length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base,
-						length_of_cube_base/2.0+(i1-1)*length_of_cube_base,
-						length_of_cube_base/2.0+((i-width_of_base/2.0)*length_of_cube_base)),0,glm::vec3(0,0,1));
-				if (heights[i2][i]==0)
-					for (int i1 = 0; i1 < height_of_base-1;i1++)
-						drawobject(water,glm::vec3(
-							length_of_cube_base/2.0+(i2-length_of_base/2.0)*length_of_cube_base,
-							length_of_cube_base/2.0+(i1-1)*length_of_cube_base,
-							length_of_cube_base/2.0+((i-width_of_base/2.0)*length_of_cube_base)),0,glm::vec3(0,0,1));
-			}
-	}
 	// cout<<person_x<<"	"<<person_z<<"	"<<empty_cube[0][0]<<"	"<<empty_cube[0][1]<<endl;
 	if (person_state==0)
 		for (int i = 0; i < no_of_pits;i++)
@@ -1787,66 +3771,6 @@ void draw ()
 			gameover=1;
 		//cout<<"fall_state==1"<<endl;
 	}
-	if (gameover==0)
-	{
-		GLfloat clr[108];
-		for (int i = 0; i <36;i++)
-		{
-			clr[3*i]=1;
-			clr[3*i+2]=0;
-			clr[3*i+1]=0;
-		}
-		if (camera_x_direction==1||camera_x_direction==-1)
-		{
-			health=createCube(clr,2,person_health/2,2);
-			drawobject(person_leg,glm::vec3(person_x,person_y+jump_speed+10,person_z+6),person_hand_angle,glm::vec3(0,0,1));
-			drawobject(person_leg,glm::vec3(person_x,person_y+jump_speed+10,person_z-6),-1*person_hand_angle,glm::vec3(0,0,1));
-		}
-		if (camera_z_direction==1||camera_z_direction==-1)
-		{
-			health=createCube(clr,person_health/2,2,2);
-			drawobject(person_leg,glm::vec3(person_x+6,person_y+jump_speed+10,person_z),-1*person_hand_angle,glm::vec3(1,0,0));
-			drawobject(person_leg,glm::vec3(person_x-6,person_y+jump_speed+10,person_z),person_hand_angle,glm::vec3(1,0,0));
-		}
-		drawobject(health,glm::vec3(person_x,person_y+100+jump_speed,person_z),0,glm::vec3(0,1,0));
-		drawobject(person_body,glm::vec3(person_x,person_y+jump_speed+12+length_of_cube_base/3,person_z),0,glm::vec3(0,0,1));
-		for (int i = 0; i < 360; ++i)
-			drawobject(person_neck,glm::vec3(person_x,person_y+jump_speed+12+length_of_cube_base,person_z),i,glm::vec3(0,1,0));
-		if (camera_x_direction==1||camera_x_direction==-1)
-		{
-			drawobject(person_head,glm::vec3(person_x,person_y+jump_speed+12+7+length_of_cube_base,person_z),0,glm::vec3(0,1,0));
-			drawobject(person_hand,glm::vec3(person_x,person_y+jump_speed+30,person_z-18),person_hand_angle,glm::vec3(0,0,1));
-			drawobject(person_hand,glm::vec3(person_x,person_y+jump_speed+30,person_z+12),-1*person_hand_angle,glm::vec3(0,0,1));
-			var1=-10;
-			if (camera_x_direction==-1)
-				var1=10;
-			for (int i = 0; i < 360;i++)
-				drawobject(person_eye,glm::vec3(person_x+var1,person_y+jump_speed+12+6+length_of_cube_base,person_z-8),i,glm::vec3(1,0,0));
-			for (int i = 0; i < 360;i++)
-				drawobject(person_eye,glm::vec3(person_x+var1,person_y+jump_speed+12+6+length_of_cube_base,person_z+8),i,glm::vec3(1,0,0));
-			var1=2;
-			if (camera_x_direction==-1)
-				var1=-2;
-			drawobject(person_hair,glm::vec3(person_x+var1,person_y+jump_speed+12+7+6+length_of_cube_base,person_z),0,glm::vec3(0,1,0));
-		}
-		else
-		{
-			drawobject(person_head,glm::vec3(person_x,person_y+jump_speed+12+7+length_of_cube_base,person_z),90,glm::vec3(0,1,0));
-			drawobject(person_hand,glm::vec3(person_x+12,person_y+jump_speed+30,person_z),person_hand_angle,glm::vec3(1,0,0));
-			drawobject(person_hand,glm::vec3(person_x-18,person_y+jump_speed+30,person_z),-1*person_hand_angle,glm::vec3(1,0,0));
-			var1=-10;
-			if (camera_z_direction==-1)
-				var1=10;
-			for (int i = 0; i < 360;i++)
-				drawobject(person_eye,glm::vec3(person_x-8,person_y+jump_speed+12+6+length_of_cube_base,person_z+var1),i,glm::vec3(0,0,1));
-			for (int i = 0; i < 360;i++)
-				drawobject(person_eye,glm::vec3(person_x+8,person_y+jump_speed+12+6+length_of_cube_base,person_z+var1),i,glm::vec3(0,0,1));
-			var1=2;
-			if (camera_z_direction==-1)
-				var1=-2;
-			drawobject(person_hair,glm::vec3(person_x,person_y+jump_speed+12+7+6+length_of_cube_base,person_z+var1),90,glm::vec3(0,1,0));
-		}
-	}
 	if (key>=2)
 	{
 		for (int i = 0; i < no_of_walls;i++)
@@ -1870,7 +3794,6 @@ void draw ()
 			 	person_health-=0.1;
 			 	gameover=1;
 			}
-			drawobject(walls,glm::vec3(wall[i][0],length_of_cube_base*3/2.0+(height_of_base-2)*length_of_cube_base,wall[i][1]),0,glm::vec3(0,0,1));
 			if (wall[i][3]==1)
 				wall[i][0]+=5;
 			else 
@@ -1885,7 +3808,7 @@ void draw ()
 	{
 		for (int i = 0; i <11;i++)
 		{
-			drawobject(spike,glm::vec3(200,spike_y[i][0],-40+(-1*i*30)),0,glm::vec3(0,1,0));
+			spike_y[i][0]=spike_low+bobOffset(spike_motion[i],anim_time);
 			var1=person_x-200;
 			if (var1<0)
 				var1*=-1;
@@ -1900,114 +3823,13 @@ void draw ()
 				//cout<<var2<<endl;
 				gameover=1;
 			}
-			if (spike_y[i][0]>=100)
-				spike_y[i][1]=-1;
-			else if (spike_y[i][0]<=45)
-				spike_y[i][1]=1;
-			if (spike_y[i][1]==1)
-				spike_y[i][0]+=0.5;
-			else
-				spike_y[i][0]-=0.5;
 		}
 	}
-	drawobject(background,glm::vec3(0,-3000,0),0,glm::vec3(0,1,0));
-	// int score1=score,var_s;
- //    double x_cor=300,y_cor=150,z_cor=300;
- //    while(score1!=0)
- //    {
- //        var_s=score1%10;
- //        if (a[var_s][0]==1)
- //            drawobject(score_cube_hor,glm::vec3(x_cor,y_cor,z_cor),0,glm::vec3(0,0,1));
- //        if (a[var_s][1]==1)
- //            drawobject(score_cube_ver,glm::vec3(x_cor+15,y_cor-15,z_cor),0,glm::vec3(0,0,1));
- //        if (a[var_s][2]==1)
- //            drawobject(score_cube_ver,glm::vec3(x_cor+15,y_cor-30,z_cor),0,glm::vec3(0,0,1));
- //        if (a[var_s][3]==1)
- //            drawobject(score_cube_hor,glm::vec3(x_cor,y_cor-30,z_cor),0,glm::vec3(0,0,1));
- //        if (a[var_s][4]==1)
- //            drawobject(score_cube_ver,glm::vec3(x_cor,y_cor-30,z_cor),0,glm::vec3(0,0,1));
- //        if (a[var_s][5]==1)
- //            drawobject(score_cube_ver,glm::vec3(x_cor,y_cor-15,z_cor),0,glm::vec3(0,0,1));
- //        if (a[var_s][6]==1)
- //            drawobject(score_cube_hor,glm::vec3(x_cor,y_cor-15,z_cor),0,glm::vec3(0,0,1));
- //        score1/=10;
- //        z_cor-=25;
- //    }
-	if (key==0)
-	{
-		drawtexture(image1,glm::vec3(287.5,120,162.5),key_angle,glm::vec3(0,1,0));
-		drawobject(arrow_haed,glm::vec3(287.5,150+arrow_y,162.5),arrow_angle,glm::vec3(0,1,0));
-		drawobject(arrow_tail,glm::vec3(287.5,180+arrow_y,162.5),arrow_angle,glm::vec3(0,1,0));
-		arrow_angle+=2;
-		if (arrow_y_direction==1)
-			arrow_y+=0.5;
-		if (arrow_y_direction==-1)
-			arrow_y-=0.5;
-		if (arrow_y>=20)
-			arrow_y_direction=-1;
-		if (arrow_y<=0)
-			arrow_y_direction=1;
-	}
-	else if (key==1)
-	{
-		drawtexture(image1,glm::vec3(-337.5,120,337.5),key_angle,glm::vec3(0,1,0));
-		drawobject(arrow_haed,glm::vec3(-337.5,150+arrow_y,337.5),arrow_angle,glm::vec3(0,1,0));
-		drawobject(arrow_tail,glm::vec3(-337.5,180+arrow_y,337.5),arrow_angle,glm::vec3(0,1,0));
-		arrow_angle+=2;
-		if (arrow_y_direction==1)
-			arrow_y+=0.5;
-		if (arrow_y_direction==-1)
-			arrow_y-=0.5;
-		if (arrow_y>=20)
-			arrow_y_direction=-1;
-		if (arrow_y<=0)
-			arrow_y_direction=1;
-	}
-	else if (key==2)
-	{
-		drawtexture(image1,glm::vec3(-337.5,120,-337.5),key_angle,glm::vec3(0,1,0));
-		drawobject(arrow_haed,glm::vec3(-337.5,150+arrow_y,-337.5),arrow_angle,glm::vec3(0,1,0));
-		drawobject(arrow_tail,glm::vec3(-337.5,180+arrow_y,-337.5),arrow_angle,glm::vec3(0,1,0));
-		arrow_angle+=2;
-		if (arrow_y_direction==1)
-			arrow_y+=0.5;
-		if (arrow_y_direction==-1)
-			arrow_y-=0.5;
-		if (arrow_y>=20)
-			arrow_y_direction=-1;
-		if (arrow_y<=0)
-			arrow_y_direction=1;
-	}
-	else if (key==3)
-	{
-		drawtexture(image1,glm::vec3(340.0,120,-340),key_angle,glm::vec3(0,1,0));
-		drawobject(arrow_haed,glm::vec3(340,150+arrow_y,-340),arrow_angle,glm::vec3(0,1,0));
-		drawobject(arrow_tail,glm::vec3(340,180+arrow_y,-340),arrow_angle,glm::vec3(0,1,0));
-		arrow_angle+=2;
-		if (arrow_y_direction==1)
-			arrow_y+=0.5;
-		if (arrow_y_direction==-1)
-			arrow_y-=0.5;
-		if (arrow_y>=20)
-			arrow_y_direction=-1;
-		if (arrow_y<=0)
-			arrow_y_direction=1;
-	}
 	if (key>=0)
 	{
 		for (int i = 0; i < no_of_moving_base;i++)
 			{
-				drawobject(moving_block,glm::vec3(moving_base[i][0],moving_base[i][1],moving_base[i][2]),0,glm::vec3(0,1,0));
-				if (moving_base[i][4]==1)
-					drawtexture(coin,glm::vec3(moving_base[i][0],moving_base[i][1]+60,moving_base[i][2]),arrow_angle,glm::vec3(0,1,0));
-				if (moving_base[i][1]>120)
-					moving_base[i][3]=-1;
-				else if (moving_base[i][1]<=60)
-					moving_base[i][3]=1;
-				if (moving_base[i][3]==1)
-					moving_base[i][1]+=0.5;
-				else
-					moving_base[i][1]-=0.5;
+				moving_base[i][1]=platform_low+bobOffset(platform_motion[i],anim_time);
 				var1=person_x-moving_base[i][0];
 				if (var1<0)
 					var1*=-1;
@@ -2046,16 +3868,433 @@ void draw ()
 				//cout<<person_y<<"	"<<moving_base[i][1]+40<<endl;
 			}
 	}
-	//drawtexture(boat1,glm::vec3(50*cos(boat_angle*M_PI/180),150,50*cos(boat_angle*M_PI/180)),boat_angle,glm::vec3(0,1,0));
-	
-
-
-	key_angle+=5;
 	prev_x=person_x;
 	prev_z=person_z;
 	prev_y=person_y;
 }
 
+/* Draw the world as it was alpha of the way from the previous tick to the last one */
+void render (double alpha)
+{
+	RenderState simulated = captureRenderState();
+	applyRenderState(interpolateRenderState(previous_tick_state, simulated, alpha));
+	anim_time = sim_time - (1-alpha)*tick_seconds;
+	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	updateCamera();
+	drawTerrain();
+	if (gameover==0)
+	{
+		updateHealthBar();
+		drawobject(health,glm::vec3(person_x,person_y+100+jump_speed,person_z),0,glm::vec3(0,1,0));
+		drawPerson();
+	}
+	if (key>=2)
+		for (int i = 0; i < no_of_walls;i++)
+			drawobject(walls,glm::vec3(wall[i][0],length_of_cube_base*3/2.0+(height_of_base-2)*length_of_cube_base,wall[i][1]),0,glm::vec3(0,0,1));
+	if (key>=3)
+		for (int i = 0; i <11;i++)
+			drawobject(spike,glm::vec3(200,spike_low,-40+(-1*i*30)),0,glm::vec3(0,1,0),spike_motion[i]);
+	drawobject(background,glm::vec3(0,-3000,0),0,glm::vec3(0,1,0));
+	if (key==0)
+	{
+		drawtexture(image1,glm::vec3(287.5,120,162.5),0,glm::vec3(0,1,0),key_motion);
+		drawobject(arrow_haed,glm::vec3(287.5,150,162.5),0,glm::vec3(0,1,0),arrow_motion);
+		drawobject(arrow_tail,glm::vec3(287.5,180,162.5),0,glm::vec3(0,1,0),arrow_motion);
+	}
+	else if (key==1)
+	{
+		drawtexture(image1,glm::vec3(-337.5,120,337.5),0,glm::vec3(0,1,0),key_motion);
+		drawobject(arrow_haed,glm::vec3(-337.5,150,337.5),0,glm::vec3(0,1,0),arrow_motion);
+		drawobject(arrow_tail,glm::vec3(-337.5,180,337.5),0,glm::vec3(0,1,0),arrow_motion);
+	}
+	else if (key==2)
+	{
+		drawtexture(image1,glm::vec3(-337.5,120,-337.5),0,glm::vec3(0,1,0),key_motion);
+		drawobject(arrow_haed,glm::vec3(-337.5,150,-337.5),0,glm::vec3(0,1,0),arrow_motion);
+		drawobject(arrow_tail,glm::vec3(-337.5,180,-337.5),0,glm::vec3(0,1,0),arrow_motion);
+	}
+	else if (key==3)
+	{
+		drawtexture(image1,glm::vec3(340.0,120,-340),0,glm::vec3(0,1,0),key_motion);
+		drawobject(arrow_haed,glm::vec3(340,150,-340),0,glm::vec3(0,1,0),arrow_motion);
+		drawobject(arrow_tail,glm::vec3(340,180,-340),0,glm::vec3(0,1,0),arrow_motion);
+	}
+	for (int i = 0; i < no_of_moving_base;i++)
+	{
+		drawobject(moving_block,glm::vec3(moving_base[i][0],platform_low,moving_base[i][2]),0,glm::vec3(0,1,0),platform_motion[i]);
+		if (moving_base[i][4]==1)
+		{
+			// The coin rides the platform and spins as well
+			Motion riding=platform_motion[i];
+			riding.spin=coin_motion.spin;
+			drawtexture(coin,glm::vec3(moving_base[i][0],platform_low+60,moving_base[i][2]),0,glm::vec3(0,1,0),riding);
+		}
+	}
+	flushRenderQueue();
+	drawHUD();
+	applyRenderState(simulated);
+}
+
+/* Input layer - GLFW callbacks only queue events. Each tick applies what arrived
+   since the last one through the game's handlers, stamped with that tick, so a
+   session can be recorded and replayed exactly */
+enum { INPUT_KEY, INPUT_MOUSE_BUTTON, INPUT_SCROLL, INPUT_CURSOR };
+enum { INPUT_LIVE, INPUT_RECORD, INPUT_REPLAY };
+
+struct InputEvent {
+	unsigned long tick;
+	int type, code, action; // code - key or mouse button
+	float x, y; // scroll offset or cursor position
+};
+
+struct InputLayer {
+	int mode;
+	GLFWwindow* window; // handed on to the handlers, NULL when headless
+	unsigned long tick; // ticks simulated so far
+	vector<InputEvent> pending; // arrived since the last tick
+	vector<InputEvent> replay; // whole session, in tick order
+	size_t next; // first replay event not applied yet
+	double cursor_x, cursor_y; // last cursor position passed on
+	string record_path;
+	vector<unsigned char> recorded; // encoded log, written out at exit
+	unsigned long recorded_tick; // tick of the last recorded event
+	int recorded_events;
+} input = {INPUT_LIVE, NULL, 0, {}, {}, 0, 0, 0, "", {}, 0, 0};
+
+/* Log format - "VINP", a version byte, then per event : the tick as a varint delta
+   from the previous event, a byte of type<<4|action, then the code as a varint for
+   keys and buttons, or x and y as two floats for scrolling and the cursor */
+const char input_log_magic[4] = {'V','I','N','P'};
+const unsigned char input_log_version = 1;
+
+void writeVarint (vector<unsigned char>& out, unsigned long value)
+{
+	while (value>=0x80)
+	{
+		out.push_back((value&0x7f)|0x80);
+		value >>= 7;
+	}
+	out.push_back(value);
+}
+
+bool readVarint (const vector<unsigned char>& in, size_t& at, unsigned long& value)
+{
+	value = 0;
+	for (int shift = 0; at<in.size() && shift<64; shift += 7)
+	{
+		unsigned char byte = in[at++];
+		value |= (unsigned long)(byte&0x7f)<<shift;
+		if (!(byte&0x80))
+			return true;
+	}
+	return false;
+}
+
+void writeFloat (vector<unsigned char>& out, float value)
+{
+	unsigned char bytes[sizeof(float)];
+	memcpy(bytes, &value, sizeof(float));
+	out.insert(out.end(), bytes, bytes+sizeof(float));
+}
+
+bool readFloat (const vector<unsigned char>& in, size_t& at, float& value)
+{
+	if (at+sizeof(float)>in.size())
+		return false;
+	memcpy(&value, &in[at], sizeof(float));
+	at += sizeof(float);
+	return true;
+}
+
+void recordInputEvent (const InputEvent& event)
+{
+	writeVarint(input.recorded, event.tick-input.recorded_tick);
+	input.recorded_tick = event.tick;
+	input.recorded.push_back(event.type<<4 | event.action);
+	if (event.type==INPUT_KEY || event.type==INPUT_MOUSE_BUTTON)
+		writeVarint(input.recorded, event.code);
+	else
+	{
+		writeFloat(input.recorded, event.x);
+		writeFloat(input.recorded, event.y);
+	}
+	input.recorded_events++;
+}
+
+/* Write the recording out - registered with atexit, as quitting calls exit() */
+void finishInputRecording ()
+{
+	if (input.mode!=INPUT_RECORD)
+		return;
+	ofstream file(input.record_path.c_str(), ios::out|ios::binary|ios::trunc);
+	file.write(input_log_magic, 4);
+	file.put(input_log_version);
+	file.write((const char*)&input.recorded[0], input.recorded.size());
+	file.close();
+	if (file.fail())
+		cout << "Error: Could not write input log `" << input.record_path << "'" << endl;
+	else
+		cout << "Input: " << input.recorded_events << " events over " << input.tick << " ticks recorded to " << input.record_path << ", " << 5+input.recorded.size() << " bytes" << endl;
+}
+
+void startInputRecording (const char* path)
+{
+	input.mode = INPUT_RECORD;
+	input.record_path = path;
+	atexit(finishInputRecording);
+}
+
+/* Decode the event at log[at] - false when the log ends inside it */
+bool readInputEvent (const vector<unsigned char>& log, size_t& at, unsigned long& tick, InputEvent& event)
+{
+	unsigned long delta, code;
+	if (!readVarint(log, at, delta) || at>=log.size())
+		return false;
+	event.tick = tick += delta;
+	event.type = log[at]>>4;
+	event.action = log[at++]&0x0f;
+	if (event.type==INPUT_KEY || event.type==INPUT_MOUSE_BUTTON)
+	{
+		if (!readVarint(log, at, code))
+			return false;
+		event.code = code;
+		return true;
+	}
+	return readFloat(log, at, event.x) && readFloat(log, at, event.y);
+}
+
+bool loadInputLog (const char* path, vector<InputEvent>& events)
+{
+	ifstream file(path, ios::in|ios::binary);
+	vector<unsigned char> log((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+	if (log.size()<5 || memcmp(&log[0], input_log_magic, 4)!=0 || log[4]!=input_log_version)
+	{
+		cout << "Error: `" << path << "' is not an input log" << endl;
+		return false;
+	}
+	size_t at = 5;
+	unsigned long tick = 0;
+	while (at<log.size())
+	{
+		InputEvent event = {0, 0, 0, 0, 0, 0};
+		if (!readInputEvent(log, at, tick, event))
+		{
+			cout << "Error: input log `" << path << "' is truncated after " << events.size() << " events" << endl;
+			return false;
+		}
+		events.push_back(event);
+	}
+	return true;
+}
+
+/* Key events of a text script - "tick key action" per line, GLFW key codes and
+   actions, # starts a comment */
+bool loadInputScript (const char* path, vector<InputEvent>& events)
+{
+	ifstream stream(path, ios::in);
+	if (!stream.is_open())
+	{
+		cout << "Error: Could not read input script `" << path << "'" << endl;
+		return false;
+	}
+	string line;
+	while (getline(stream, line))
+	{
+		InputEvent event = {0, INPUT_KEY, 0, 0, 0, 0};
+		if (line.find('#')!=string::npos)
+			line.erase(line.find('#'));
+		if (sscanf(line.c_str(), "%lu %d %d", &event.tick, &event.code, &event.action)==3)
+			events.push_back(event);
+	}
+	stable_sort(events.begin(), events.end(), [](const InputEvent& a, const InputEvent& b) { return a.tick<b.tick; });
+	return true;
+}
+
+/* Replay a log, or a script when the file is not a log. A replay that cannot be
+   read in full would silently diverge, so the run stops instead */
+void startInputReplay (const char* path)
+{
+	input.mode = INPUT_REPLAY;
+	input.next = 0;
+	ifstream file(path, ios::in|ios::binary);
+	char magic[4] = {0};
+	file.read(magic, 4);
+	bool loaded = memcmp(magic, input_log_magic, 4)==0 ? loadInputLog(path, input.replay) : loadInputScript(path, input.replay);
+	if (!loaded)
+		exit(EXIT_FAILURE);
+}
+
+void queueInput (int type, int code, int action, double x, double y)
+{
+	if (input.mode==INPUT_REPLAY)
+		return;
+	InputEvent event = {0, type, code, action, (float)x, (float)y};
+	input.pending.push_back(event);
+}
+
+void queueKey (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (action!=GLFW_REPEAT)
+		queueInput(INPUT_KEY, key, action, 0, 0);
+}
+
+void queueMouseButton (GLFWwindow* window, int button, int action, int mods)
+{
+	queueInput(INPUT_MOUSE_BUTTON, button, action, 0, 0);
+}
+
+void queueScroll (GLFWwindow* window, double xoffset, double yoffset)
+{
+	queueInput(INPUT_SCROLL, 0, 0, xoffset, yoffset);
+}
+
+/* The cursor is sampled once a frame and only moves are queued */
+void queueCursor (double x, double y)
+{
+	if (x==input.cursor_x && y==input.cursor_y)
+		return;
+	input.cursor_x = x;
+	input.cursor_y = y;
+	queueInput(INPUT_CURSOR, 0, 0, x, y);
+}
+
+void applyInputEvent (const InputEvent& event)
+{
+	switch (event.type)
+	{
+		case INPUT_KEY:
+			keyboard(input.window, event.code, 0, event.action, 0);
+			break;
+		case INPUT_MOUSE_BUTTON:
+			mouseButton(input.window, event.code, event.action, 0);
+			break;
+		case INPUT_SCROLL:
+			mousescroll(input.window, event.x, event.y);
+			break;
+		case INPUT_CURSOR:
+			xmousePos = event.x;
+			ymousePos = event.y;
+			break;
+	}
+}
+
+/* State digest stream - "VDIG", a version byte, then one 64 bit hash of the game
+   state per tick, in tick order. Two runs that agree tick for tick simulated the
+   same game bit for bit */
+const char digest_magic[4] = {'V','D','I','G'};
+const unsigned char digest_version = 1;
+
+struct StateDigest {
+	bool enabled;
+	ofstream stream;
+} state_digest;
+
+void startStateDigest (const char* path)
+{
+	state_digest.stream.open(path, ios::out|ios::binary|ios::trunc);
+	if (!state_digest.stream.is_open())
+	{
+		cout << "Error: Could not write state digest `" << path << "'" << endl;
+		return;
+	}
+	state_digest.stream.write(digest_magic, 4);
+	state_digest.stream.put(digest_version);
+	state_digest.enabled = true;
+}
+
+unsigned long long hashGameState ()
+{
+	unsigned long long hash = hashBytes("", 0);
+	const double player[6] = {person_x, person_y, person_z, person_health, key, score};
+	hash = hashBytes(player, sizeof(player), hash);
+	hash = hashBytes(heights, sizeof(heights), hash);
+	hash = hashBytes(moving_base, sizeof(moving_base), hash);
+	hash = hashBytes(wall, sizeof(wall), hash);
+	hash = hashBytes(spike_y, sizeof(spike_y), hash);
+	return hash;
+}
+
+bool readDigests (const char* path, vector<unsigned long long>& digests)
+{
+	ifstream file(path, ios::in|ios::binary);
+	char magic[4] = {0};
+	file.read(magic, 4);
+	if (memcmp(magic, digest_magic, 4)!=0 || file.get()!=digest_version)
+	{
+		cout << "Error: `" << path << "' is not a state digest" << endl;
+		return false;
+	}
+	unsigned long long digest;
+	while (file.read((char*)&digest, sizeof(digest)))
+		digests.push_back(digest);
+	return true;
+}
+
+/* Compare two digest streams, reporting the first tick they disagree on. Returns
+   the process exit status - 0 when the runs match */
+int compareDigests (const char* first, const char* second)
+{
+	vector<unsigned long long> a, b;
+	if (!readDigests(first, a) || !readDigests(second, b))
+		return 2;
+	size_t common = min(a.size(), b.size());
+	for (size_t tick = 0; tick < common; tick++)
+		if (a[tick]!=b[tick])
+		{
+			cout << "Digests diverge at tick " << tick << " (" << first << " " << hex << a[tick] << ", " << second << " " << b[tick] << dec << ")" << endl;
+			return 1;
+		}
+	if (a.size()!=b.size())
+	{
+		cout << "Digests match for " << common << " ticks, then " << (a.size()<b.size() ? first : second) << " ends" << endl;
+		return 1;
+	}
+	cout << "Digests match for all " << common << " ticks" << endl;
+	return 0;
+}
+
+/* Apply this tick's input and advance the game by one tick */
+void tickSimulation ()
+{
+	if (input.mode==INPUT_REPLAY)
+	{
+		for (; input.next<input.replay.size() && input.replay[input.next].tick<=input.tick; input.next++)
+			applyInputEvent(input.replay[input.next]);
+	}
+	else
+	{
+		for (size_t i = 0; i < input.pending.size(); i++)
+		{
+			input.pending[i].tick = input.tick;
+			if (input.mode==INPUT_RECORD)
+				recordInputEvent(input.pending[i]);
+			applyInputEvent(input.pending[i]);
+		}
+		input.pending.clear();
+	}
+	update(tick_seconds);
+	if (state_digest.enabled)
+	{
+		unsigned long long digest = hashGameState();
+		state_digest.stream.write((const char*)&digest, sizeof(digest));
+	}
+	input.tick++;
+}
+
+/* Run the simulation alone for up to ticks ticks - no window, GL context or audio,
+   so any number of these can run side by side. Input can only come from a replay.
+   One summary line is printed at the end */
+void runHeadless (long ticks)
+{
+	intialize_base();
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	long tick = 0;
+	for (; tick < ticks && gameend==0 && !quit_requested; tick++)
+		tickSimulation();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+	cout << "Headless: " << tick << " ticks in " << seconds << " s, " << tick/max(seconds, 1e-9) << " ticks/s - player at " << person_x << ", " << person_y << ", " << person_z << ", score " << score << ", health " << person_health << ", key " << key << (gameend ? ", game completed" : "") << (quit_requested ? ", quit" : "") << endl;
+}
+
 GLFWwindow* initGLFW (int width, int height)
 {
 	GLFWwindow* window; // window desciptor/handle
@@ -2079,7 +4318,7 @@ GLFWwindow* initGLFW (int width, int height)
 
 	glfwMakeContextCurrent(window);
 	gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-	glfwSwapInterval( 1 );
+	glfwSwapInterval( swap_interval );
 
 	/* --- register callbacks with GLFW --- */
 
@@ -2093,64 +4332,75 @@ GLFWwindow* initGLFW (int width, int height)
 	glfwSetWindowCloseCallback(window, quit);
 
 	/* Register function to handle keyboard input */
-	glfwSetKeyCallback(window, keyboard);      // general keyboard input
+	glfwSetKeyCallback(window, queueKey);      // general keyboard input, applied by the next tick
 	glfwSetCharCallback(window, keyboardChar);  // simpler specific character handling
 
 	/* Register function to handle mouse click */
 	
-	glfwSetMouseButtonCallback(window, mouseButton);  // mouse button clicks
+	glfwSetMouseButtonCallback(window, queueMouseButton);  // mouse button clicks, applied by the next tick
 	return window;
 }
 
 void initGL (GLFWwindow* window, int width, int height)
 {
 	intialize_base();
+	openMeshRegistry();
 	glActiveTexture(GL_TEXTURE0);
-	GLuint textureID = createTexture("key.jpg");
-	if(textureID == 0 )
-		cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-	textureProgramID = LoadShaders( "TextureRender.vert", "TextureRender.frag" );
-	Matrices.TexMatrixID = glGetUniformLocation(textureProgramID, "MVP");
-	programID = LoadShaders( "Sample_GL3.vert", "Sample_GL3.frag" );
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+	// Every sprite comes from one atlas, so all of them draw with one texture bound.
+	// It comes from the texture cache when the images are unchanged, otherwise they
+	// decode on worker threads while the shaders compile below
+	const char* sprite_files[] = {"key.jpg", "coin.jpg", "boat1.png", "boat2.png", "boat3.jpg", "boat4.jpg"};
+	unsigned long long sprite_key = hashFiles(sprite_files, 6);
+	glm::vec4 sprite_regions[6];
+	TextureHandle atlas = loadTextureCache(sprite_key, sprite_regions, 6);
+	if (atlas==0)
+		startImageLoads(image_loader, sprite_files, 6);
+	// Camera block - one uniform buffer all programs read view/projection from
+	Matrices.CameraBlock = genBuffer();
+	bufferData(Matrices.CameraBlock, GL_UNIFORM_BUFFER, sizeof(CameraUniforms), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, Matrices.CameraBlock);
+	for (unsigned features = 0; features < (1<<SHADER_FEATURES); features++)
+	{
+		meshPrograms[features] = LoadShaders( "Sample_GL3.vert", "Sample_GL3.frag", features );
+		bindCameraBlock(meshPrograms[features]);
+		if (features & SHADER_TEXTURED)
+		{
+			useProgram(meshPrograms[features]);
+			glUniform1i(glGetUniformLocation(meshPrograms[features], "texSampler"), 0); // Sampler unit never changes
+		}
+	}
+	terrainProgramID = LoadShaders( "Terrain.vert", "Sample_GL3.frag" );
+	bindCameraBlock(terrainProgramID);
+	Matrices.TerrainScaleID = glGetUniformLocation(terrainProgramID, "positionScale");
+	skinnedProgramID = LoadShaders( "Skinned.vert", "Sample_GL3.frag" );
+	bindCameraBlock(skinnedProgramID);
+	Matrices.BonesID = glGetUniformLocation(skinnedProgramID, "Bones");
+	if (atlas==0)
+	{
+		finishImageLoads(image_loader);
+		atlas = createAtlas(image_loader.images, sprite_regions);
+		freeImageLoads(image_loader);
+		saveTextureCache(sprite_key, atlas, sprite_regions, 6);
+	}
+	resettleGLResources();
 	reshapeWindow (window, width, height);
 	glClearColor (0.3f, 0.3f, 0.3f, 0.0f); // R, G, B, A
 	glClearDepth (1.0f);
 	glEnable (GL_DEPTH_TEST);
 	glDepthFunc (GL_LEQUAL);
 	const char* fontfile = "arial.ttf";
-	GL3Font.font = new FTExtrudeFont(fontfile); // 3D extrude style rendering
-	if(GL3Font.font->Error())
+	if(!loadGlyphFont(fontfile, 24, hud_font))
 	{
 		cout << "Error: Could not load font `" << fontfile << "'" << endl;
 		glfwTerminate();
 		exit(EXIT_FAILURE);
 	}
-	image1 = createRectangle(textureID,10,15);
-	textureID = createTexture("coin.jpg");
-	if(textureID == 0 )
-		cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-	coin=createRectangle(textureID,100,150);
-	
-	textureID = createTexture("boat1.png");
-	if(textureID == 0 )
-		cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-	boat1=createRectangle(textureID,1000,1500);
-
-	textureID = createTexture("boat2.png");
-	if(textureID == 0 )
-		cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-	boat2=createRectangle(textureID,1000,1500);
-
-	textureID = createTexture("boat3.jpg");
-	if(textureID == 0 )
-		cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-	boat3=createRectangle(textureID,1000,1500);
-
-	textureID = createTexture("boat4.jpg");
-	if(textureID == 0 )
-		cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-	boat4=createRectangle(textureID,10000,15000);
+	image1 = createRectangle(atlas,sprite_regions[0],10,15);
+	coin=createRectangle(atlas,sprite_regions[1],100,150);
+	boat1=createRectangle(atlas,sprite_regions[2],1000,1500);
+	boat2=createRectangle(atlas,sprite_regions[3],1000,1500);
+	boat3=createRectangle(atlas,sprite_regions[4],1000,1500);
+	boat4=createRectangle(atlas,sprite_regions[5],10000,15000);
 
 	
 	GLfloat clr[108];
@@ -2173,28 +4423,16 @@ void initGL (GLFWwindow* window, int width, int height)
 		}
 	}	
 	cube=createCube(clr,length_of_cube_base/2,length_of_cube_base/2,length_of_cube_base/2);
+	for (int i = 0; i < 6; i++)
+		for (int i1 = 0; i1 < 3; i1++)
+			terrain_face_colors[i][i1]=clr[18*i+i1];
 	for (int i = 0; i <108;i++)
 	{
 		clr[i]=0;
 	}
-	score_cube_ver=createCube(clr,10,10,5);
-	score_cube_hor=createCube(clr,10,5,10);
 	moving_block=createCube(clr,20,20,40);
-	person_body=createCube(clr,length_of_cube_base/2,length_of_cube_base/2,length_of_cube_base/2);
-	person_leg=createCube1(clr,4,4,-12);
-	person_neck=createCube(clr,3,3,7);
-	for (int i = 0; i <108;i++)
-		clr[i]=0.5;
-	person_head=createCube(clr,10,18,6);
-	for (int i = 0; i <108;i++)
-		clr[i]=0.7;
-	person_hair=createCube(clr,11,22,4);
-	for (int i = 0; i <108;i++)
-		clr[i]=0;
-	person_eye=createCube(clr,2,2,2);
-	for (int i = 0; i <108;i++)
-		clr[i]=1;
-	person_hand=createCube1(clr,3,3,-10);
+	person=createPerson();
+	health=createDynamicObject(GL_TRIANGLES);
 	for (int i = 0; i <36;i++)
 	{
 		clr[3*i]=0.501;
@@ -2230,18 +4468,12 @@ void initGL (GLFWwindow* window, int width, int height)
 		clr[3*i+2]=0.905;
 	}
 	background=createCube(clr,3000,3000,3000);
+	closeMeshRegistry();
 	fontProgramID = LoadShaders( "fontrender.vert", "fontrender.frag" );
-	GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
-	fontVertexCoordAttrib = glGetAttribLocation(fontProgramID, "vertexPosition");
-	fontVertexNormalAttrib = glGetAttribLocation(fontProgramID, "vertexNormal");
-	fontVertexOffsetUniform = glGetUniformLocation(fontProgramID, "pen");
-	GL3Font.fontMatrixID = glGetUniformLocation(fontProgramID, "MVP");
-	GL3Font.fontColorID = glGetUniformLocation(fontProgramID, "fontColor");
-	GL3Font.font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
-	GL3Font.font->FaceSize(1);
-	GL3Font.font->Depth(0);
-	GL3Font.font->Outset(0, 0);
-	GL3Font.font->CharMap(ft_encoding_unicode);
+	createTextBatch();
+	segmentProgramID = LoadShaders( "Segments.vert", "Sample_GL3.frag" );
+	createSegmentHUD();
+	cout << "Programs: " << program_cache.loaded << " from binary cache, " << program_cache.compiled << " compiled" << (program_cache.supported ? "" : " (driver has no program binary formats)") << endl;
 	cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
 	cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
 	cout << "VERSION: " << glGetString(GL_VERSION) << endl;
@@ -2250,11 +4482,40 @@ void initGL (GLFWwindow* window, int width, int height)
 
 int main (int argc, char** argv)
 {
+	bool headless = false;
+	long headless_ticks = 3600;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--uncapped")==0)
+			swap_interval = 0; // render as fast as possible, the simulation rate is fixed anyway
+		else if (strcmp(argv[i], "--stats")==0)
+			show_stats = 1;
+		else if (strcmp(argv[i], "--headless")==0)
+			headless = true;
+		else if (strcmp(argv[i], "--ticks")==0 && i+1<argc)
+			headless_ticks = atol(argv[++i]);
+		else if ((strcmp(argv[i], "--replay")==0 || strcmp(argv[i], "--script")==0) && i+1<argc)
+			startInputReplay(argv[++i]); // a binary log, or a text script of key events
+		else if (strcmp(argv[i], "--record")==0 && i+1<argc)
+			startInputRecording(argv[++i]);
+		else if (strcmp(argv[i], "--digest")==0 && i+1<argc)
+			startStateDigest(argv[++i]); // hash of the game state after every tick
+		else if (strcmp(argv[i], "--compare-digests")==0 && i+2<argc)
+			return compareDigests(argv[i+1], argv[i+2]);
+	}
+	if (headless)
+	{
+		runHeadless(headless_ticks);
+		return 0;
+	}
 	GLFWwindow* window = initGLFW(width, height);
 
 	initGL (window, width, height);
+	input.window = window;
 
 	double last_update_time = glfwGetTime(), current_time;
+	double last_frame_time = last_update_time, accumulator = 0;
+	previous_tick_state = captureRenderState();
 
 	/* Draw in loop */
 	// person_x=100;
@@ -2263,20 +4524,40 @@ int main (int argc, char** argv)
 	while (!glfwWindowShouldClose(window)) {
 		//cout<<person_x<<"	drawrawdraw";
 
-		// OpenGL Draw commands
-		draw();
+		// Run the ticks the time since the last frame covers, then draw between the last two
+		current_time = glfwGetTime();
+		accumulator += min(current_time - last_frame_time, max_frame_seconds);
+		last_frame_time = current_time;
+		while (accumulator >= tick_seconds*(1-1e-6)) // tolerate rounding in the clock
+		{
+			previous_tick_state = captureRenderState();
+			tickSimulation();
+			accumulator -= tick_seconds;
+		}
+		render(min(max(accumulator/tick_seconds, 0.0), 1.0));
 
 		// Swap Frame Buffer in double buffering
 		glfwSwapBuffers(window);
-        glfwGetCursorPos(window,&xmousePos,&ymousePos);
+		collectGLResources();
+		endGLStateFrame();
+		double cursor_x, cursor_y;
+		glfwGetCursorPos(window,&cursor_x,&cursor_y);
+		queueCursor(cursor_x, cursor_y);
 		// Poll for Keyboard and mouse events
 		glfwPollEvents();
-		glfwSetScrollCallback(window, mousescroll);
+		glfwSetScrollCallback(window, queueScroll);
 		// Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
 		current_time = glfwGetTime(); // Time in seconds
 		if ((current_time - last_update_time) >= 0.5) { // atleast 0.5s elapsed since last frame
 			// do something every 0.5 seconds ..
 			last_update_time = current_time;
+			if (show_stats)
+			{
+				checkGLObjectLeaks();
+				reportGLState();
+				reportRenderQueue();
+				reportSegmentHUD();
+			}
 		}
 		// if (person_y<0)//length_of_cube_base*3/2.0+(height_of_base-2)*length_of_cube_base-10)
 		// {
@@ -2288,30 +4569,8 @@ int main (int argc, char** argv)
 		if (gameend==1)
 			break;
 		//cout<<person_health<<endl;
-		cout<<score<<endl;
 		//cout<<person_y<<"	"<<length_of_cube_base*3/2.0+(height_of_base-2)*length_of_cube_base<<endl;
 		//cout<<person_jump<<"	"<<person_state<<endl;
-		// glm::vec3 fontColor = glm::vec3(0,0,0);
-		// glUseProgram(fontProgramID);
-		// Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-		// glm::mat4 MVP;
-		// // Transform the text
-		// Matrices.model = glm::mat4(1.0f);
-		// glm::mat4 translateText = glm::translate(glm::vec3(200,130,200));
-		// glm::mat4 scaleText = glm::scale(glm::vec3(500,500,500));
-		// Matrices.model *= (translateText * scaleText);
-		// MVP = Matrices.projection * Matrices.view * Matrices.model;
-		// // send font's MVP and font color to fond shaders
-		// glUniformMatrix4fv(GL3Font.fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
-		// glUniform3fv(GL3Font.fontColorID, 1, &fontColor[0]);
-		// reshapeWindow_val=0;
-		// reshapeWindow(window,width,height);
-		
-		// // Render font
-		// GL3Font.font->Render("SCORE:");
-		// reshapeWindow_val=1;
-		// reshapeWindow(window,width,height);
-
 		
 	}
 